@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace oak_bench
+{
+
+// Per-operation latency samples, in nanoseconds
+struct result
+{
+    std::string name;
+    std::vector<double> samples;
+    std::uint64_t ops = 0;
+    double wall_ns = 0;
+};
+
+inline std::uint64_t now_ns()
+{
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+// Nearest-rank percentile, samples must be sorted
+inline double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    auto rank = static_cast<std::size_t>(
+        p / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+/*
+ * Runs f() iterations * batch times, timing every batch separately.
+ * Cheap operations (filtered calls, enqueue) use a batch > 1 so that
+ * the clock overhead does not dominate the sample.
+ */
+template <typename F>
+result measure(const std::string &name, std::size_t iterations,
+               std::size_t batch, F &&f)
+{
+    result r;
+    r.name = name;
+    r.samples.reserve(iterations);
+
+    // warmup
+    for (std::size_t i = 0; i < batch * 16; ++i)
+        f();
+
+    auto begin = now_ns();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        auto start = now_ns();
+        for (std::size_t j = 0; j < batch; ++j)
+            f();
+        auto end = now_ns();
+        r.samples.push_back(static_cast<double>(end - start)
+                            / static_cast<double>(batch));
+    }
+    r.wall_ns = static_cast<double>(now_ns() - begin);
+    r.ops = iterations * batch;
+    return r;
+}
+
+inline void print_header(std::FILE *out)
+{
+    std::fprintf(out, "%-44s %10s %10s %10s %10s %10s %12s %14s\n",
+                 "benchmark", "ops", "mean(ns)", "p50(ns)", "p99(ns)",
+                 "p99.9(ns)", "max(ns)", "ops/s");
+}
+
+inline void print_result(std::FILE *out, result &r)
+{
+    std::sort(r.samples.begin(), r.samples.end());
+    double sum = 0;
+    for (auto s : r.samples)
+        sum += s;
+    double mean =
+        r.samples.empty() ? 0 : sum / static_cast<double>(r.samples.size());
+    double throughput =
+        r.wall_ns > 0 ? static_cast<double>(r.ops) * 1e9 / r.wall_ns : 0;
+    std::fprintf(out,
+                 "%-44s %10llu %10.1f %10.1f %10.1f %10.1f %12.1f %14.0f\n",
+                 r.name.c_str(), static_cast<unsigned long long>(r.ops), mean,
+                 percentile(r.samples, 50), percentile(r.samples, 99),
+                 percentile(r.samples, 99.9),
+                 r.samples.empty() ? 0 : r.samples.back(), throughput);
+}
+
+// Power of two buckets, samples must be sorted
+inline void print_histogram(std::FILE *out, const std::vector<double> &sorted)
+{
+    if (sorted.empty())
+        return;
+    std::size_t i = 0;
+    for (double bound = 64; i < sorted.size(); bound *= 2)
+    {
+        std::size_t count = 0;
+        while (i < sorted.size() && sorted[i] < bound)
+        {
+            ++count;
+            ++i;
+        }
+        if (count == 0)
+            continue;
+        double share =
+            static_cast<double>(count) / static_cast<double>(sorted.size());
+        std::fprintf(out, "  < %12.0f ns %10zu %6.2f%% ", bound, count,
+                     share * 100);
+        for (int bar = 0; bar < static_cast<int>(share * 50); ++bar)
+            std::fputc('#', out);
+        std::fputc('\n', out);
+    }
+}
+
+} // namespace oak_bench
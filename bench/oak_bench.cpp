@@ -0,0 +1,452 @@
+#include "bench.hpp"
+#include "faulty_sink.hpp"
+#include "oak/oak.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifdef OAK_USE_SOCKETS
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+using namespace oak_bench;
+
+static std::FILE *report = stdout;
+
+static void emit(result r)
+{
+    print_result(report, r);
+    std::fflush(report);
+}
+
+static void set_flag_bits(unsigned long bits)
+{
+    oak::set_flags(oak::flags::none);
+    for (unsigned long bit = 1; bit <= 64; bit <<= 1)
+        if (bits & bit)
+            oak::add_flags(static_cast<oak::flags>(bit));
+}
+
+static std::string flag_names(unsigned long bits)
+{
+    static const char *names[] = {"level", "date", "time", "pid",
+                                  "tid",   "json", "color"};
+    std::string s;
+    for (unsigned long i = 0; i < 7; ++i)
+    {
+        if (!(bits & (1ul << i)))
+            continue;
+        if (!s.empty())
+            s += "|";
+        s += names[i];
+    }
+    return s.empty() ? "none" : s;
+}
+
+static void drain_queue()
+{
+    std::lock_guard<std::mutex> lock(oak::logger::log_mutex);
+    oak::logger::log_queue.clear();
+}
+
+#ifdef OAK_USE_SOCKETS
+// A local unix socket that accepts one connection and discards its input
+struct null_socket_server
+{
+    std::string path;
+    int listen_fd = -1;
+    std::thread reader;
+
+    bool start()
+    {
+        path = std::format("/tmp/oak-bench-{}.sock", getpid());
+        std::filesystem::remove(path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0)
+            return false;
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        std::snprintf(addr.sun_path, sizeof(addr.sun_path), "%s",
+                      path.c_str());
+        if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(listen_fd, 1) < 0)
+            return false;
+        reader = std::thread(
+            [this]
+            {
+                int fd = accept(listen_fd, nullptr, nullptr);
+                if (fd < 0)
+                    return;
+                char buf[65536];
+                while (read(fd, buf, sizeof(buf)) > 0)
+                {
+                }
+                close(fd);
+            });
+        return true;
+    }
+
+    void stop()
+    {
+        if (reader.joinable())
+            reader.join();
+        if (listen_fd >= 0)
+            close(listen_fd);
+        std::filesystem::remove(path);
+    }
+};
+#endif
+
+/*
+ * End-to-end: every producer thread logs `per_thread` messages, then the
+ * writer is stopped so that the wall time includes draining the queue
+ * to the sinks.
+ */
+static result end_to_end(const std::string &name, std::size_t threads,
+                         std::size_t per_thread)
+{
+    result r;
+    r.name = name;
+    std::vector<std::vector<double>> samples(threads);
+
+    oak::init_writer();
+    auto begin = now_ns();
+    std::vector<std::thread> producers;
+    for (std::size_t t = 0; t < threads; ++t)
+    {
+        producers.emplace_back(
+            [&samples, t, per_thread]
+            {
+                samples[t].reserve(per_thread);
+                for (std::size_t i = 0; i < per_thread; ++i)
+                {
+                    auto start = now_ns();
+                    oak::info("request {} served in {} us by worker {}", i,
+                              1234, t);
+                    samples[t].push_back(
+                        static_cast<double>(now_ns() - start));
+                }
+            });
+    }
+    for (auto &p : producers)
+        p.join();
+    oak::stop_writer();
+    oak::flush();
+    r.wall_ns = static_cast<double>(now_ns() - begin);
+
+    for (auto &s : samples)
+        r.samples.insert(r.samples.end(), s.begin(), s.end());
+    r.ops = threads * per_thread;
+    return r;
+}
+
+/*
+ * Producer latency with a custom sink that is healthy, slow, or stalled
+ * for the whole run: the writer stays blocked in the sink while the
+ * producers keep logging.
+ */
+static result faulty_sink_run(const std::string &name, std::size_t iterations,
+                              long delay_us, bool stalled)
+{
+    using namespace std::chrono_literals;
+    auto sink = std::make_shared<faulty_sink>();
+    sink->delay_us = delay_us;
+    oak::add_sink(sink);
+    oak::init_writer();
+    if (stalled)
+    {
+        sink->stall();
+        oak::info("stall the writer");
+        while (sink->stalled_writes() == 0)
+            std::this_thread::sleep_for(1ms);
+    }
+    auto call = [] { oak::info("request {} served in {} us", 42, 1234); };
+    result r;
+    std::atomic<bool> returned = false;
+    std::thread producer(
+        [&]
+        {
+            r = measure(name, iterations, 1, call);
+            returned = true;
+        });
+    if (stalled)
+    {
+        // Every call must return while the sink is still stalled
+        auto deadline = std::chrono::steady_clock::now() + 60s;
+        while (!returned && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(1ms);
+        if (!returned)
+        {
+            std::fprintf(stderr,
+                         "oak_bench: %s: producers blocked on the sink\n",
+                         name.c_str());
+            std::exit(1);
+        }
+    }
+    producer.join();
+    sink->delay_us = 0;
+    sink->release();
+    oak::stop_writer();
+    oak::remove_sink(sink);
+    return r;
+}
+
+// Counts the records it receives
+struct counting_sink : oak::sink
+{
+    std::atomic<std::uint64_t> records = 0;
+
+    ssize_t write(const char *, std::size_t size) override
+    {
+        records.fetch_add(1, std::memory_order_release);
+        return static_cast<ssize_t>(size);
+    }
+};
+
+/*
+ * Delivery latency at idle: the time from the call until the record
+ * reaches the sink, one record at a time.
+ */
+static result delivery_latency(const std::string &name, std::size_t iterations,
+                               oak::write_mode mode)
+{
+    auto sink = std::make_shared<counting_sink>();
+    oak::add_sink(sink);
+    oak::set_write_mode(mode);
+    oak::init_writer();
+    std::uint64_t expected = 0;
+    auto r = measure(name, iterations, 1,
+                     [&sink, &expected]
+                     {
+                         oak::info("request {} served in {} us", 42, 1234);
+                         ++expected;
+                         while (sink->records.load(std::memory_order_acquire)
+                                < expected)
+                         {
+                         }
+                     });
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::remove_sink(sink);
+    return r;
+}
+
+static std::vector<std::size_t> thread_counts(std::size_t max_threads)
+{
+    std::vector<std::size_t> counts;
+    for (std::size_t t = 1; t < max_threads; t *= 2)
+        counts.push_back(t);
+    counts.push_back(max_threads);
+    return counts;
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t iterations = 20000;
+    std::size_t max_threads = std::thread::hardware_concurrency();
+    if (argc > 1)
+        iterations = std::strtoul(argv[1], nullptr, 10);
+    if (argc > 2)
+        max_threads = std::strtoul(argv[2], nullptr, 10);
+    if (iterations == 0)
+        iterations = 1;
+    if (max_threads == 0)
+        max_threads = 1;
+
+    // The writer prints to stdout: send it to /dev/null and keep the
+    // original stdout for the report.
+    int report_fd = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (report_fd < 0 || devnull < 0)
+    {
+        std::perror("oak_bench");
+        return 1;
+    }
+    std::fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    report = fdopen(report_fd, "w");
+
+    print_header(report);
+
+    // Filtered-out call: the level check only
+    oak::set_level(oak::level::error);
+    emit(measure("log filtered out", iterations, 100,
+                 [] { oak::debug("filtered {}", 42); }));
+    oak::set_backlog(oak::level::debug, 256);
+    emit(measure("log filtered into backlog", iterations, 10,
+                 [] { oak::debug("filtered {} {}", 42, "str"); }));
+    oak::set_backlog(oak::level::disabled, 0);
+
+    oak::set_level(oak::level::debug);
+
+    // log_to_string alone
+    oak::set_flags(oak::flags::level);
+    emit(measure("log_to_string", iterations, 1,
+                 []
+                 {
+                     auto s = oak::log_to_string(oak::level::info,
+                                                 "value {} {}", 42, "str");
+                     (void) s;
+                 }));
+
+    // The fast {} path vs std::vformat_to, per argument type
+    std::string out;
+    int value = 0;
+    emit(measure("vformat_append int", iterations, 10,
+                 [&out]
+                 {
+                     out.clear();
+                     int v = -1234567;
+                     oak::vformat_append(out, "{}", std::make_format_args(v));
+                 }));
+    emit(measure("vformat_append double", iterations, 10,
+                 [&out]
+                 {
+                     out.clear();
+                     double v = 3.14159;
+                     oak::vformat_append(out, "{}", std::make_format_args(v));
+                 }));
+    emit(measure("vformat_append pointer", iterations, 10,
+                 [&out, &value]
+                 {
+                     out.clear();
+                     const void *v = &value;
+                     oak::vformat_append(out, "{}", std::make_format_args(v));
+                 }));
+    emit(measure("std::vformat_to int double pointer", iterations, 10,
+                 [&out, &value]
+                 {
+                     out.clear();
+                     int i = -1234567;
+                     double d = 3.14159;
+                     const void *p = &value;
+                     std::vformat_to(std::back_inserter(out), "{} {} {}",
+                                     std::make_format_args(i, d, p));
+                 }));
+    emit(measure("vformat_append int double pointer", iterations, 10,
+                 [&out, &value]
+                 {
+                     out.clear();
+                     int i = -1234567;
+                     double d = 3.14159;
+                     const void *p = &value;
+                     oak::vformat_append(out, "{} {} {}",
+                                         std::make_format_args(i, d, p));
+                 }));
+
+    // Hex dump of a binary payload vs std::format of every byte
+    std::vector<std::byte> payload(4096);
+    for (std::size_t i = 0; i < payload.size(); ++i)
+        payload[i] = static_cast<std::byte>(i * 37);
+    emit(measure("hex 4KiB oak::hex", iterations, 1,
+                 [&out, &payload]
+                 {
+                     out.clear();
+                     std::format_to(std::back_inserter(out), "{}",
+                                    oak::hex(payload));
+                 }));
+    emit(measure("hex 4KiB std::format", iterations, 1,
+                 [&out, &payload]
+                 {
+                     out.clear();
+                     for (auto b : payload)
+                         std::format_to(std::back_inserter(out), "{:02x}",
+                                        std::to_integer<unsigned>(b));
+                 }));
+
+    // Every combination of flags
+    for (unsigned long bits = 0; bits < 128; ++bits)
+    {
+        set_flag_bits(bits);
+        emit(measure("log_to_string flags=" + flag_names(bits),
+                     std::max<std::size_t>(iterations / 10, 1), 1,
+                     []
+                     {
+                         auto s = oak::log_to_string(
+                             oak::level::info, "value {} {}", 42, "str");
+                         (void) s;
+                     }));
+    }
+
+    // Enqueue only, no writer running
+    oak::set_flags(oak::flags::level);
+    std::string message = "[ level=info ] a preformatted message\n";
+    emit(measure("enqueue only", iterations, 10,
+                 [&message]
+                 { oak::add_to_queue(message, oak::destination::std_out); }));
+    drain_queue();
+
+    // JSON vs text, producer side with the writer running
+    oak::set_flags(oak::flags::level, oak::flags::date, oak::flags::time);
+    emit(end_to_end("log text", 1, iterations));
+    oak::set_flags(oak::flags::json, oak::flags::level, oak::flags::date,
+                   oak::flags::time);
+    emit(end_to_end("log json", 1, iterations));
+
+    // Throughput to each sink with 1..N producers
+    oak::set_flags(oak::flags::level, oak::flags::time);
+    std::size_t total = iterations;
+    for (auto t : thread_counts(max_threads))
+        emit(end_to_end(std::format("e2e null sink threads={}", t), t,
+                        std::max<std::size_t>(total / t, 1)));
+
+    // A slow or stalled sink must not show up in the producer latency
+    emit(faulty_sink_run("producer custom sink healthy", iterations, 0,
+                         false));
+    emit(faulty_sink_run("producer custom sink slow 100us", iterations, 100,
+                         false));
+    emit(faulty_sink_run("producer custom sink stalled", iterations, 0,
+                         true));
+
+    // Wakeup of the writer vs writing from the caller
+    emit(delivery_latency("delivery idle queued", iterations,
+                          oak::write_mode::queued));
+    emit(delivery_latency("delivery idle hybrid", iterations,
+                          oak::write_mode::hybrid));
+    oak::set_write_mode(oak::write_mode::hybrid);
+    for (auto t : thread_counts(max_threads))
+        emit(end_to_end(std::format("e2e null sink hybrid threads={}", t), t,
+                        std::max<std::size_t>(total / t, 1)));
+    oak::set_write_mode(oak::write_mode::automatic);
+
+    // One queue per CPU instead of the shared one
+    oak::set_ordering(oak::ordering::per_cpu);
+    for (auto t : thread_counts(max_threads))
+        emit(end_to_end(std::format("e2e null sink per_cpu threads={}", t),
+                        t, std::max<std::size_t>(total / t, 1)));
+    oak::set_ordering(oak::ordering::strict);
+
+    auto file = std::format("/tmp/oak-bench-{}.log", getpid());
+    if (oak::set_file(file).has_value())
+    {
+        for (auto t : thread_counts(max_threads))
+            emit(end_to_end(std::format("e2e file sink threads={}", t), t,
+                            std::max<std::size_t>(total / t, 1)));
+        oak::close_file();
+    }
+    std::filesystem::remove(file);
+
+#ifdef OAK_USE_SOCKETS
+    null_socket_server server;
+    if (server.start() && oak::set_socket(server.path).has_value())
+    {
+        for (auto t : thread_counts(max_threads))
+            emit(end_to_end(std::format("e2e socket sink threads={}", t), t,
+                            std::max<std::size_t>(total / t, 1)));
+    }
+    oak::close_socket();
+    server.stop();
+#endif
+
+    std::fclose(report);
+    close(devnull);
+    return 0;
+}
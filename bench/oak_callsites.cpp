@@ -0,0 +1,65 @@
+/*
+ * Code size of oak::log call sites. This file is compiled twice by the
+ * oak_callsite_size target: as is, and with OAK_CALLSITES_INLINE where
+ * every call expands the formatting in place, the way the header did
+ * before it was moved out of line. The target prints the size of both
+ * objects.
+ */
+
+#include "oak/oak.hpp"
+
+#include <iterator>
+#include <string>
+
+#ifdef OAK_CALLSITES_INLINE
+template <typename... Args>
+inline void log_inline(const oak::level &lvl, std::string_view fmt,
+                       Args &&...args)
+{
+    if (oak::get_level() > lvl)
+        return;
+    thread_local std::string message;
+    auto flags = oak::get_flags();
+    bool json = flags & static_cast<long unsigned int>(oak::flags::json);
+    message.clear();
+    oak::format_prefix(message, lvl, flags);
+    if (json)
+        message += "\"message\": \"";
+    try
+    {
+        std::vformat_to(std::back_inserter(message), fmt,
+                        std::make_format_args(args...));
+    }
+    catch (const std::exception &e)
+    {
+        return;
+    }
+    message += json ? "\" }\n" : "\n";
+    oak::add_to_queue(message, oak::destination::all, lvl,
+                      flags & static_cast<long unsigned int>(oak::flags::color));
+}
+#define CALL(lvl, ...) log_inline(lvl, __VA_ARGS__)
+#else
+#define CALL(lvl, ...) oak::log(lvl, __VA_ARGS__)
+#endif
+
+void callsites(int i, double d, const std::string &s)
+{
+    using oak::level;
+    CALL(level::debug, "request {} started", i);
+    CALL(level::debug, "parsed {} bytes from {}", i, s);
+    CALL(level::info, "request {} took {} ms", i, d);
+    CALL(level::info, "cache hit ratio {}", d);
+    CALL(level::info, "user {} logged in from {}", s, i);
+    CALL(level::warn, "slow query {} took {} ms on {}", i, d, s);
+    CALL(level::warn, "retrying {} after {} ms", s, i);
+    CALL(level::error, "request {} failed: {}", i, s);
+    CALL(level::error, "connection to {} lost after {} s", s, d);
+    CALL(level::debug, "queue depth {} high water {}", i, i * 2);
+    CALL(level::info, "flushed {} records in {} ms", i, d);
+    CALL(level::debug, "state {} -> {}", s, s);
+    CALL(level::info, "{} {} {} {}", i, d, s, i);
+    CALL(level::warn, "disk usage {}%", d);
+    CALL(level::error, "invalid header {} in {}", i, s);
+    CALL(level::output, "done {}", i);
+}
@@ -26,22 +26,40 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <ctime>
-#include <deque>
 #include <expected>
 #include <filesystem>
 #include <format>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <optional>
 #include <ostream>
+#include <span>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unistd.h>
+#include <vector>
 
 #ifdef OAK_USE_SOCKETS
 #include <cstring>
@@ -126,7 +144,17 @@ enum class flags
     pid = 8,
     tid = 16,
     json = 32,
-    color = 64
+    color = 64,
+    seq = 128 // sequence number, to restore the call order offline
+};
+
+// Order in which the writer writes the queued records
+enum class ordering
+{
+    strict = 0, // the order of the queue
+    priority,   // warn and error records first, through their own lane
+    fair,       // a queue per thread, served in deficit round robin
+    per_cpu,    // a queue per CPU, merged by sequence number
 };
 
 enum class destination
@@ -134,29 +162,343 @@ enum class destination
     std_out = 0,
     file,
     socket,
+    custom, // the sinks added with oak::add_sink
+    all,    // every open destination, chosen by the writer
     _max_destination
 };
 
+// How records are written to the log file, see set_file_format()
+enum class file_format
+{
+    text = 0, // as formatted
+    framed,   // every record after a frame_header
+};
+
+// Who writes a record to the sinks
+enum class write_mode
+{
+    automatic = 0, // the writer thread if it runs, else the caller
+    queued,        // always the writer thread, queued until it runs
+    direct,        // always the calling thread
+    hybrid,        // the caller if the queue is empty and no one writes
+};
+
+// What the overload controller gives up on the records below warn
+enum class overload_action
+{
+    raise_level = 0, // raise the effective level, one level per step
+    sample,          // keep 1 in `sample` records, 1 in sample^2 at step 2
+};
+
+/*
+ * A user defined destination, see oak::add_sink. write() has the
+ * semantics of POSIX write: it may write less than `size` bytes, and
+ * returns -1 setting errno on error. The writer retries partial writes,
+ * EINTR and EAGAIN, any other error loses the record for this sink.
+ * Sinks are only called from the writer thread.
+ */
+class sink
+{
+  public:
+    virtual ~sink() = default;
+    virtual ssize_t write(const char *data, std::size_t size) = 0;
+    virtual int flush()
+    {
+        return 0;
+    }
+};
+
 struct queue_element
 {
     std::string message;
-    oak::destination dest;
-    inline queue_element(const std::string &msg, const oak::destination &d)
-        : message(std::move(msg)), dest(d)
+    oak::destination dest = oak::destination::std_out;
+    oak::level lvl = oak::level::output;
+    bool color = false;
+    std::uint64_t enqueue_ns = 0; // steady ns, the merge key of per_cpu
+    std::uint64_t seq = 0;
+    queue_element() = default;
+    inline queue_element(const std::string &msg, const oak::destination &d,
+                         const oak::level &l = oak::level::output,
+                         bool c = false, std::uint64_t t = 0,
+                         std::uint64_t n = 0)
+        : message(std::move(msg)), dest(d), lvl(l), color(c), enqueue_ns(t),
+          seq(n)
+    {
+    }
+};
+
+// Advice on a range of memory before its first write, see oak::warmup()
+using memory_advice = void (*)(std::pair<void *, std::size_t> range);
+
+/*
+ * FIFO of records backed by a ring of slots that are never freed: the
+ * string of a consumed slot keeps its capacity for the next record, so
+ * that in steady state enqueueing does not allocate. The ring only
+ * grows when the backlog exceeds its size.
+ */
+class record_queue
+{
+  public:
+    inline queue_element &push()
+    {
+        if (count == slots.size())
+            grow();
+        auto &slot = slots[(head + count) % slots.size()];
+        count++;
+        return slot;
+    }
+
+    inline queue_element &front()
+    {
+        return slots[head];
+    }
+
+    inline void pop_front()
+    {
+        head = (head + 1) % slots.size();
+        count--;
+    }
+
+    inline bool empty() const
+    {
+        return count == 0;
+    }
+
+    inline std::size_t size() const
+    {
+        return count;
+    }
+
+    inline void clear()
+    {
+        head = 0;
+        count = 0;
+    }
+
+    inline std::size_t capacity() const
+    {
+        return slots.size();
+    }
+
+    /*
+     * Grows the ring to `n` slots and writes `bytes` into the string of
+     * every free slot, so that their pages are mapped before a record
+     * needs them. `advise` gets the new slot array before it is written.
+     */
+    inline void reserve(std::size_t n, std::size_t bytes,
+                        memory_advice advise = nullptr)
+    {
+        if (n > slots.size())
+        {
+            if (advise)
+            {
+                slots.reserve(n);
+                advise({slots.data(), n * sizeof(queue_element)});
+            }
+            resize(n);
+        }
+        for (auto i = count; i < slots.size(); ++i)
+        {
+            auto &message = slots[(head + i) % slots.size()].message;
+            message.assign(std::max(bytes, message.capacity()), '\0');
+            message.clear();
+        }
+    }
+
+  private:
+    std::vector<queue_element> slots;
+    std::size_t head = 0;
+    std::size_t count = 0;
+
+    inline void grow()
     {
+        resize(std::max<std::size_t>(1024, slots.size() * 2));
     }
+
+    inline void resize(std::size_t n)
+    {
+        // Linearize the ring before growing it
+        std::rotate(slots.begin(),
+                    slots.begin() + static_cast<std::ptrdiff_t>(head),
+                    slots.end());
+        head = 0;
+        auto old_size = slots.size();
+        slots.resize(n);
+        // Sized for a typical record up front, so that which slot gets
+        // the longest records does not decide when allocations stop
+        for (auto i = old_size; i < slots.size(); ++i)
+            slots[i].message.reserve(256);
+    }
+};
+
+// The records of one thread in fair ordering, see set_ordering()
+struct producer_queue
+{
+    record_queue records;
+    std::string tid;
+    std::size_t deficit = 0;        // bytes it may still send this round
+    std::uint64_t window_start = 0; // of the quota window, steady ns
+    std::size_t window_bytes = 0;   // accepted in the quota window
+    std::size_t throttled = 0;      // dropped over quota, not reported yet
+    std::size_t throttled_bytes = 0;
+    bool exited = false; // the thread is gone, removed once drained
+};
+
+// The records enqueued on one CPU in per_cpu ordering, see set_ordering()
+struct alignas(64) cpu_queue
+{
+    std::atomic_flag lock; // a spinlock, held for one push or swap
+    std::atomic_flag draining; // held by the writer that drains `spare`
+    std::atomic<std::size_t> size = 0; // read by the writer without lock
+    record_queue records;
+    record_queue spare; // swapped with records by a drain, node local too
+    int node = 0;       // NUMA node of the CPU
+};
+
+/*
+ * Histogram of durations in nanoseconds with power of two buckets:
+ * bucket i counts the values with std::bit_width(value) == i.
+ */
+struct histogram
+{
+    static constexpr std::size_t buckets = 64;
+    std::array<std::uint64_t, buckets> counts = {};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t max = 0;
+
+    static constexpr std::size_t bucket(std::uint64_t ns)
+    {
+        return std::min<std::size_t>(std::bit_width(ns), buckets - 1);
+    }
+
+    inline void add(std::uint64_t ns)
+    {
+        counts[bucket(ns)]++;
+        count++;
+        sum += ns;
+        max = std::max(max, ns);
+    }
+
+    inline void merge(const histogram &other)
+    {
+        for (std::size_t i = 0; i < buckets; ++i)
+            counts[i] += other.counts[i];
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    inline double mean() const
+    {
+        return count == 0 ? 0
+                          : static_cast<double>(sum)
+                                / static_cast<double>(count);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile
+    inline std::uint64_t percentile(double p) const
+    {
+        auto rank = static_cast<std::uint64_t>(
+            p / 100.0 * static_cast<double>(count));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets; ++i)
+        {
+            seen += counts[i];
+            if (seen > rank || (seen == count && seen > 0))
+                return std::min<std::uint64_t>((1ull << i) - 1, max);
+        }
+        return max;
+    }
+};
+
+struct sink_stats
+{
+    std::uint64_t writes = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t errors = 0;
+    histogram latency;
+};
+
+constexpr std::size_t num_levels = static_cast<std::size_t>(level::_max_level);
+constexpr std::size_t num_sinks = static_cast<std::size_t>(destination::all);
+
+/*
+ * Snapshot of the internal metrics, see oak::stats(). Producer side
+ * counters are kept per thread and summed when the snapshot is taken.
+ * Everything but the queue depth is zero if oak was compiled without
+ * OAK_USE_STATS.
+ */
+struct stats_snapshot
+{
+    std::array<std::uint64_t, num_levels> messages = {};
+    std::array<std::uint64_t, num_levels> bytes = {};
+    std::uint64_t drops = 0;
+    std::uint64_t direct_writes = 0; // written by the calling thread
+    std::size_t queue_depth = 0;
+    std::size_t queue_high_water = 0;
+    histogram enqueue_wait;
+    histogram writer_lag;
+    std::array<sink_stats, num_sinks> sinks = {};
 };
 
 struct logger
 {
-    static long unsigned int flag_bits;
-    static level log_level;
+    // Read without a lock by every oak::log call
+    static std::atomic<long unsigned int> flag_bits;
+    static std::atomic<level> log_level; // raised under overload
+    static std::atomic<std::uint64_t> sample_one_in; // 0 = no sampling
+    static std::atomic<level> backlog_level;
+    static std::atomic<level> entry_level; // the lower of the two above
+    static std::atomic<std::size_t> backlog_size;
     static std::ofstream log_file;
-    static std::deque<queue_element> log_queue;
+    static std::string log_file_path;
+    static std::atomic<file_format> log_file_format;
+    static std::size_t index_records; // see set_file_index()
+    static std::size_t index_bytes;
+    static std::size_t search_segment_bytes; // see set_search_index()
+    static std::size_t search_filter_bytes;
+    static bool per_process_files;
+    static record_queue log_queue;
+    static record_queue urgent_queue; // warn and error in priority order
+    static std::vector<std::unique_ptr<producer_queue>> producers;
+    static std::size_t producers_size; // records in the producer queues
+    static std::size_t producer_next;  // where the next round starts
+    static std::size_t producer_quota; // bytes per second, 0 = none
+    static std::size_t cpu_count;
+    static std::vector<cpu_queue *> cpu_queues; // one per CPU, node local
+    static bool cpu_queues_used; // per_cpu ordering was set once
+    static int writer_node;      // -1 = anywhere
+    static bool node_writers;
+    // Size the writer keeps its own rings at, see warmup()
+    static std::atomic<std::size_t> warm_records;
+    static std::atomic<std::size_t> warm_bytes;
+    static std::atomic<bool> warm_huge_pages;
     static std::mutex log_mutex;
     static std::condition_variable log_cv;
     static std::atomic<bool> close_writer;
+    static std::atomic<bool> writer_running;
+    static std::atomic<write_mode> mode;
     static std::optional<std::jthread> writer_thread;
+    // Held by the writer while it writes, producers never wait on it
+    static std::mutex sink_mutex;
+    static std::vector<std::shared_ptr<sink>> sinks;
+    static std::atomic<std::size_t> in_flight; // taken, not written yet
+    static std::atomic<std::size_t> queue_capacity;
+    static std::size_t queue_high_water;
+    static std::atomic<std::uint64_t> sequence;
+    static std::atomic<ordering> order;
+    static bool urgent_flush;
+    static level base_level; // as set by set_level()
+    static std::size_t overload_high;
+    static std::size_t overload_low;
+    static overload_action overload_act;
+    static unsigned overload_sample;
+    static unsigned overload_step;
+    static std::chrono::milliseconds stats_interval;
+    static std::chrono::milliseconds shutdown_deadline;
+    static std::string stats_file;
+    static bool stats_log;
 #ifdef OAK_USE_SOCKETS
     static int log_socket;
 #endif
@@ -164,14 +506,21 @@ struct logger
 
 inline level get_level()
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
-    return logger::log_level;
+    return logger::log_level.load(std::memory_order_relaxed);
+}
+
+// Publishes the level a record is looked at from, log_mutex must be held
+inline void update_entry_level()
+{
+    logger::entry_level.store(
+        std::min(get_level(),
+                 logger::backlog_level.load(std::memory_order_relaxed)),
+        std::memory_order_relaxed);
 }
 
 inline long unsigned int get_flags()
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
-    return logger::flag_bits;
+    return logger::flag_bits.load(std::memory_order_relaxed);
 }
 
 inline bool is_file_open()
@@ -180,28 +529,353 @@ inline bool is_file_open()
     return logger::log_file.is_open();
 }
 
-inline void set_level(const oak::level &lvl)
+// Records enqueued and not written yet
+std::size_t queue_size();
+
+void set_level(const oak::level &lvl);
+
+/*
+ * In direct mode the calling thread writes the record to every sink
+ * itself, one write per record and sink, serialized with the other
+ * threads. It needs no writer thread. In hybrid mode it does so only
+ * when nothing is queued and the sinks are free, and queues otherwise:
+ * no wakeup latency when idle, no waiting on the sinks under load.
+ */
+inline void set_write_mode(write_mode m)
+{
+    logger::mode.store(m, std::memory_order_relaxed);
+}
+
+/*
+ * In a framed file every record follows a frame_header with its size
+ * and checksum: a torn or garbage tail left by a crash is detected and
+ * cut by recover_framed_file(), which set_file() runs on the file before
+ * appending to it. Set it before set_file().
+ */
+inline void set_file_format(file_format f)
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
-    logger::log_level = lvl;
+    logger::log_file_format.store(f, std::memory_order_relaxed);
 }
 
 [[nodiscard]]
 std::expected<int, std::string> set_file(const std::string &file);
 void close_file();
 
+// CRC32C (Castagnoli) of data, continuing `crc`, SSE4.2 when available
+std::uint32_t crc32c(const void *data, std::size_t size,
+                     std::uint32_t crc = 0);
+
+// Precedes every record of a framed file
+struct frame_header
+{
+    static constexpr std::uint32_t magic_value = 0xf56b616f; // oak\xf5
+    std::uint32_t magic = magic_value;
+    std::uint32_t size = 0; // of the record
+    std::uint32_t crc = 0;  // crc32c of size, then of the record
+};
+
+struct recovery_report
+{
+    std::uint64_t size = 0;      // kept, up to the end of the last record
+    std::uint64_t truncated = 0; // bytes of torn tail cut
+};
+
+/*
+ * Finds the last valid record of a framed file, scanning back from its
+ * end, and truncates the file after it.
+ */
+[[nodiscard]] std::expected<recovery_report, std::string>
+recover_framed_file(const std::string &path);
+
+bool is_framed_file(const std::string &path);
+
+struct framed_contents
+{
+    std::string records; // the valid records, in file order
+    std::size_t count = 0;
+    std::uint64_t corrupted = 0; // bytes skipped to the next valid frame
+};
+
+[[nodiscard]] std::expected<framed_contents, std::string>
+read_framed_file(const std::string &path);
+
+/*
+ * Writes an entry to the sidecar index `<file>.idx` of the log file
+ * every `records` records or every `bytes` bytes, whichever comes first,
+ * 0 for never. Set it before set_file(), see read_time_range().
+ */
+inline void set_file_index(std::size_t records, std::size_t bytes = 0)
+{
+    std::lock_guard<std::mutex> lock(logger::sink_mutex);
+    logger::index_records = records;
+    logger::index_bytes = bytes;
+}
+
+// An entry of the index of a log file, see set_file_index()
+struct index_entry
+{
+    std::uint64_t time_ns = 0; // system clock, when the record was written
+    std::uint64_t seq = 0;
+    std::uint64_t offset = 0; // of the record in the log file
+};
+
+// The index of the log file at `path`
+[[nodiscard]] std::expected<std::vector<index_entry>, std::string>
+read_file_index(const std::string &path);
+
+/*
+ * Calls f with the records of the log file written from `from` to `to`,
+ * found by a binary search of its index and read through mmap. The range
+ * is widened to the index entries around it. A text file is passed in
+ * chunks, a framed file one record at a time without its frame. Returns
+ * the bytes passed to f.
+ */
+[[nodiscard]] std::expected<std::uint64_t, std::string>
+read_time_range(const std::string &path,
+                std::chrono::system_clock::time_point from,
+                std::chrono::system_clock::time_point to,
+                const std::function<void(std::string_view)> &f);
+
+/*
+ * Cuts the log file into segments of `segment_bytes` and writes a bloom
+ * filter of the tokens of every segment to `<file>.bloom`, so that
+ * search_file() skips the segments that cannot hold a term. A token is
+ * a run of letters, digits and `_-.`, the keys and values of json
+ * records included. A filter of 0 bytes is sized to segment_bytes / 16.
+ * A segment of 0 bytes turns it off. Set it before set_file().
+ */
+inline void set_search_index(std::size_t segment_bytes,
+                             std::size_t filter_bytes = 0)
+{
+    std::lock_guard<std::mutex> lock(logger::sink_mutex);
+    logger::search_segment_bytes = segment_bytes;
+    logger::search_filter_bytes = filter_bytes;
+}
+
+// Precedes the filter of every segment in a `<file>.bloom` sidecar
+struct bloom_header
+{
+    static constexpr std::uint32_t magic_value = 0x6d6f6c62; // blom
+    std::uint32_t magic = magic_value;
+    std::uint32_t hashes = 0;
+    std::uint64_t begin = 0; // offsets of the segment in the log file
+    std::uint64_t end = 0;
+    std::uint64_t bits = 0; // of the filter that follows, a power of two
+};
+
+struct search_report
+{
+    std::size_t segments = 0; // with a filter
+    std::size_t skipped = 0;  // ruled out by their filter
+    std::size_t matches = 0;
+};
+
+/*
+ * Calls f with every record of the log file, without its newline, that
+ * holds every token of `query`. Only the segments whose filter may hold
+ * them all are read, and the parts of the file no filter covers.
+ */
+[[nodiscard]] std::expected<search_report, std::string>
+search_file(const std::string &path, std::string_view query,
+            const std::function<void(std::string_view)> &f);
+
+/*
+ * In a child forked after init_writer(), reopen the log file as
+ * `<file>.<pid>` instead of appending to the file of the parent.
+ */
+inline void set_per_process_files(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::per_process_files = enabled;
+}
+
 #ifdef OAK_USE_SOCKETS
 void close_socket();
 #endif
 
-void add_to_queue(const std::string &str, const destination &d);
+inline void set_queue_capacity(std::size_t capacity)
+{
+    logger::queue_capacity.store(capacity, std::memory_order_relaxed);
+}
+
+/*
+ * Priority ordering gives warn and error records their own lane: the
+ * writer writes them before the backlog, the queue capacity does not
+ * drop them, and with `flush` every one is flushed at once. With
+ * flags::seq the records carry their sequence number, which restores
+ * the call order offline.
+ *
+ * Fair ordering queues the records of every thread apart, and the
+ * writer takes about the same number of bytes from each in turn: a
+ * thread logging in a loop delays its own records only. The queue
+ * capacity then applies to each thread.
+ *
+ * Per CPU ordering queues a record on the CPU the thread runs on, under
+ * a spinlock of that CPU only: the memory follows the number of CPUs,
+ * and producers on different CPUs share no lock nor counter. The writer
+ * merges the queues by enqueue time, the records of a thread stay in
+ * order, and numbers them.
+ */
+inline void set_ordering(ordering o, bool flush = false)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::order.store(o, std::memory_order_relaxed);
+    logger::urgent_flush = flush;
+    if (o == ordering::per_cpu)
+        logger::cpu_queues_used = true;
+}
+
+/*
+ * NUMA placement, a nop on a single node or without libnuma. The writer
+ * started by init_writer() runs on the CPUs of `node`, -1 for anywhere.
+ */
+inline void set_writer_node(int node)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::writer_node = node;
+}
+
+/*
+ * With per_cpu ordering, init_writer() also starts a writer per NUMA
+ * node, on the CPUs of the node. It drains the queues of those CPUs and
+ * writes the records for every destination to `<file>.node<N>` instead
+ * of the log file, with its format and sidecars, the other sinks only
+ * get the records sent to them alone. set_file() moves them too.
+ * Without it the writer merges every node by enqueue time.
+ */
+inline void set_node_writers(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::node_writers = enabled;
+}
+
+// NUMA nodes of the machine, 1 without libnuma
+int numa_nodes();
+
+// See oak::warmup()
+struct warmup_options
+{
+    std::size_t records = 4096;    // slots of every queue
+    std::size_t record_size = 256; // bytes written in every slot
+    bool huge_pages = false;       // advise transparent huge pages
+    bool lock = false;             // mlockall() once everything is warm
+};
+
+/*
+ * Allocates the queues, the buffers of the calling thread and of the
+ * writer, and writes every page once, so that logging up to `records`
+ * records of `record_size` bytes takes no page fault. Call it from
+ * every thread that logs on a hot path, after set_ordering() and
+ * set_backlog(). With huge_pages every buffer it allocates is advised
+ * MADV_HUGEPAGE before its first write. The buffers come from malloc,
+ * they are not mapped with MAP_HUGETLB: the kernel backs them with
+ * transparent huge pages if it can.
+ */
+[[nodiscard]] std::expected<int, std::string> warmup(
+    const warmup_options &options = {});
+
+/*
+ * In fair ordering, the bytes a thread may queue per second, 0 for no
+ * limit. The records over it are dropped and the writer logs how many.
+ */
+inline void set_producer_quota(std::size_t bytes_per_second)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::producer_quota = bytes_per_second;
+}
+
+/*
+ * Overload control: once the queue holds `high` records, the records
+ * below warn are degraded by `action`, one step more at 2 * high, and
+ * restored once it is back to `low`. Every change is logged as a warn
+ * record. A `high` of 0 turns it off.
+ */
+void set_overload(std::size_t high, std::size_t low,
+                  overload_action action = overload_action::raise_level,
+                  unsigned sample = 10);
+
+// A seq of 0 takes the next sequence number
+void add_to_queue(std::string_view str, const destination &d,
+                  const level &lvl = level::output, bool color = false,
+                  std::uint64_t seq = 0);
+
+void add_sink(std::shared_ptr<sink> s);
+void remove_sink(const std::shared_ptr<sink> &s);
+
+// The first page of a ring file, offsets are from data_offset
+struct ring_header
+{
+    static constexpr std::uint64_t magic_value = 0x31676e69726b616f; // oakring1
+    std::uint64_t magic = 0;
+    std::uint64_t data_offset = 0;
+    std::uint64_t data_size = 0;
+    std::uint64_t head = 0; // the oldest record
+    std::uint64_t tail = 0; // where the next record goes
+    std::uint64_t used = 0; // bytes from head to tail
+    std::uint64_t generation = 0; // times the tail wrapped around
+};
+
+/*
+ * A sink writing into one preallocated file of fixed size, mapped in
+ * memory and used as a circular buffer: a record overwrites the oldest
+ * ones, the head then moves to the next whole record. A record larger
+ * than the file keeps its end. See open_ring_file().
+ */
+class ring_file : public sink
+{
+  public:
+    ~ring_file() override;
+    ssize_t write(const char *data, std::size_t size) override;
+    int flush() override; // msync of the mapping
+
+  private:
+    friend std::expected<std::shared_ptr<ring_file>, std::string>
+    open_ring_file(const std::string &path, std::size_t size);
+
+    ring_file() = default;
+
+    int fd = -1;
+    void *map = nullptr;
+    std::size_t map_size = 0;
+    ring_header *header = nullptr;
+    char *data = nullptr;
+};
+
+/*
+ * Opens or creates a ring file of `size` bytes, rounded up to pages,
+ * and allocates its blocks on disk. An existing ring file of the same
+ * size is appended to, one of another size starts over empty. Add it
+ * with oak::add_sink:
+ *     oak::add_sink(oak::open_ring_file("/var/log/app.ring", 64 << 20).value());
+ */
+[[nodiscard]] std::expected<std::shared_ptr<ring_file>, std::string>
+open_ring_file(const std::string &path, std::size_t size);
+
+bool is_ring_file(const std::string &path);
+
+// The records of a ring file, oldest first
+[[nodiscard]] std::expected<std::string, std::string>
+read_ring_file(const std::string &path);
+
+stats_snapshot stats();
+void reset_stats();
+
+// Prometheus text exposition format of a snapshot
+std::string to_prometheus(const stats_snapshot &snap);
+
+/*
+ * Exports the metrics every `interval` from the writer thread: to a
+ * Prometheus textfile collector file if `file` is not empty, and as a
+ * summary record written to every sink if `log_line` is true, idle or
+ * not. An interval of zero disables the export.
+ */
+void set_stats_export(std::chrono::milliseconds interval,
+                      const std::string &file = "", bool log_line = false);
 
 template <typename... Args> void add_flags(flags flg, Args &&...args)
 {
-    {
-        std::lock_guard<std::mutex> lock(logger::log_mutex);
-        logger::flag_bits |= static_cast<long unsigned int>(flg);
-    }
+    logger::flag_bits.fetch_or(static_cast<long unsigned int>(flg),
+                               std::memory_order_relaxed);
     if (sizeof...(args) > 0)
     {
         add_flags(args...);
@@ -211,148 +885,141 @@ template <typename... Args> void add_flags(flags flg, Args &&...args)
 // Base case
 template <typename... Args> void add_flags(flags flg)
 {
-    {
-        std::lock_guard<std::mutex> lock(logger::log_mutex);
-        logger::flag_bits |= static_cast<long unsigned int>(flg);
-    }
+    logger::flag_bits.fetch_or(static_cast<long unsigned int>(flg),
+                               std::memory_order_relaxed);
 }
 
 template <typename... Args> void set_flags(flags flg, Args &&...args)
 {
-    {
-        std::lock_guard<std::mutex> lock(logger::log_mutex);
-        logger::flag_bits = 0;
-    }
+    logger::flag_bits.store(0, std::memory_order_relaxed);
     add_flags(flg, args...);
 }
 
 void writer();
+/*
+ * Starts the writer thread. It also installs fork handlers: a fork
+ * waits for the queue to drain, and the child starts its own writer.
+ */
 void init_writer();
-void stop_writer();
+
+// What stop_writer() did with the records still queued
+struct shutdown_report
+{
+    std::size_t drained = 0;   // written after stop_writer() was called
+    std::size_t discarded = 0; // left at the deadline, or rejected
+    bool deadline_expired = false;
+};
+
+/*
+ * Drains the queue within the shutdown deadline, then flushes and syncs
+ * every sink and stops the writer. While it runs, new records are
+ * rejected instead of waiting. A writer still blocked in a sink a second
+ * after the deadline is abandoned and its records count as discarded,
+ * so that it returns anyway. It also runs at exit if the writer is
+ * still running.
+ */
+shutdown_report stop_writer();
+
+inline void set_shutdown_deadline(std::chrono::milliseconds deadline)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::shutdown_deadline = deadline;
+}
 
 [[nodiscard]] std::expected<int, std::string> settings_file(
     const std::string &file);
 
-template <typename... Args>
-std::string constexpr log_to_string(const level &lvl, const std::string &fmt,
-                                    Args &&...args)
+inline std::string_view level_name(const level &lvl)
 {
-    auto flags = get_flags();
-    bool json = false;
-    if (flags & static_cast<long unsigned int>(flags::json))
-        json = true;
-    std::string prefix = "";
-    if (flags > 0 && !json)
-    {
-        prefix += "[ ";
-    }
-    if (json)
+    switch (lvl)
     {
-        prefix += "{ ";
-    }
-    if (flags & static_cast<long unsigned int>(flags::level))
-    {
-        if (json)
-            prefix +=
-                std::vformat("\"level\": \"{}\"", std::make_format_args(lvl));
-        else
-            prefix += std::vformat("level={} ", std::make_format_args(lvl));
-    }
-    if (flags & static_cast<long unsigned int>(flags::date))
-    {
-        auto now = std::chrono::system_clock::now();
-        auto now_time_t = std::chrono::system_clock::to_time_t(now);
-        std::tm now_tm = *std::localtime(&now_time_t);
-        std::ostringstream oss;
-        if (json)
-            oss << ", \"date\": \"" << std::put_time(&now_tm, "%Y-%m-%d")
-                << "\"";
-        else
-            oss << "date=" << std::put_time(&now_tm, "%Y-%m-%d") << " ";
-        prefix += oss.str();
-    }
-    if (flags & static_cast<long unsigned int>(flags::time))
-    {
-        auto now = std::chrono::system_clock::now();
-        auto now_time_t = std::chrono::system_clock::to_time_t(now);
-        std::tm now_tm = *std::localtime(&now_time_t);
-        std::ostringstream oss;
-        if (json)
-            oss << ", \"time\": \"" << std::put_time(&now_tm, "%H:%M:%S")
-                << "\"";
-        else
-            oss << "time=" << std::put_time(&now_tm, "%H:%M:%S") << " ";
-        prefix += oss.str();
-    }
-    if (flags & static_cast<long unsigned int>(flags::pid))
-    {
-        std::string pid = std::to_string(getpid());
-        if (json)
-            prefix += ", \"pid\": " + pid;
-        else
-            prefix += std::vformat("pid={} ", std::make_format_args(pid));
-    }
-    if (flags & static_cast<long unsigned int>(flags::tid))
-    {
-        std::ostringstream oss;
-        oss << std::this_thread::get_id();
-        std::string tid = oss.str();
-        if (json)
-            prefix += ", \"tid\": " + tid;
-        else
-            prefix += std::vformat("tid={} ", std::make_format_args(tid));
+    case level::debug:
+        return "debug";
+    case level::info:
+        return "info";
+    case level::warn:
+        return "warn";
+    case level::error:
+        return "error";
+    case level::output:
+        return "output";
+    default:
+        return "unknown";
     }
+}
 
-    if (flags - static_cast<long unsigned int>(flags::json) > 0 && !json)
-        prefix += "] ";
-    if (flags - static_cast<long unsigned int>(flags::json) > 0 && json)
-        prefix += ", ";
-    try {
-        std::string formatted_string =
-            std::vformat(fmt, std::make_format_args(std::forward<Args>(args)...));
-        if (json)
-            return std::vformat("{}\"message\": \"{}\" }}\n",
-                                std::make_format_args(prefix, formatted_string));
-        return std::vformat("{}{}\n",
-                            std::make_format_args(prefix, formatted_string));
-    } catch (const std::exception &e) {
-        return "";
-    }
+// Appends the metadata selected by the flags
+// A `when` of 0 is now
+void format_prefix(std::string &out, const level &lvl,
+                   long unsigned int flags, std::uint64_t seq = 0,
+                   std::time_t when = 0);
+
+/*
+ * Formats a record into out, reusing its memory. On a format error out
+ * is left empty. Compiled once in oak.cpp, the templates only erase the
+ * argument types.
+ */
+void vformat_record(std::string &out, const level &lvl, std::string_view fmt,
+                    std::format_args args, std::uint64_t seq = 0);
+
+/*
+ * Appends a formatted message to out, compiled once in oak.cpp. A
+ * format string with bare {} placeholders and arguments of builtin
+ * types is formatted without std::vformat_to.
+ */
+void vformat_append(std::string &out, std::string_view fmt,
+                    std::format_args args);
+
+template <typename... Args>
+void format_record(std::string &out, const level &lvl, std::string_view fmt,
+                   Args &...args)
+{
+    vformat_record(out, lvl, fmt, std::make_format_args(args...));
 }
 
+/*
+ * Formats and enqueues a record, the out of line part of oak::log: the
+ * call sites only keep the level check and this call.
+ */
+void vlog(const level &lvl, std::string_view fmt, std::format_args args,
+          const destination &d = destination::all);
+
 template <typename... Args>
-void log_to_stdout(const level &lvl, const std::string &fmt, Args &&...args)
+std::string log_to_string(const level &lvl, std::string_view fmt,
+                          Args &&...args)
 {
-    if (get_level() > lvl)
-        return;
-    std::string message = log_to_string(lvl, fmt, args...);
-    add_to_queue(message, oak::destination::std_out);
+    std::string out;
+    format_record(out, lvl, fmt, args...);
+    return out;
 }
 
-inline void log_to_stdout(const std::string &str)
+template <typename... Args>
+void log_to_stdout(const level &lvl, std::string_view fmt, Args &&...args)
 {
-    add_to_queue(str, oak::destination::std_out);
+    if (get_level() > lvl) [[likely]]
+        return;
+    vlog(lvl, fmt, std::make_format_args(args...), destination::std_out);
 }
 
+void log_to_stdout(const std::string &str);
+
 template <typename... Args>
-void log_to_file(const level &lvl, const std::string &fmt, Args &&...args)
+void log_to_file(const level &lvl, std::string_view fmt, Args &&...args)
 {
-    if (get_level() > lvl && !is_file_open())
+    if (get_level() > lvl && !is_file_open()) [[likely]]
         return;
-    std::string message = log_to_string(lvl, fmt, args...);
-    add_to_queue(message, oak::destination::file);
+    vlog(lvl, fmt, std::make_format_args(args...), destination::file);
 }
 
 void log_to_file(const std::string &str);
 
 #ifdef OAK_USE_SOCKETS
 template <typename... Args>
-void log_to_socket(const level &lvl, const std::string &fmt, Args &&...args)
+void log_to_socket(const level &lvl, std::string_view fmt, Args &&...args)
 {
-    if (get_level() > lvl || logger::log_socket < 0)
+    if (get_level() > lvl || logger::log_socket < 0) [[likely]]
         return;
-    std::string formatted_string = log_to_string(lvl, fmt, args...);
-    add_to_queue(formatted_string, oak::destination::socket);
+    vlog(lvl, fmt, std::make_format_args(args...), destination::socket);
 }
 
 void log_to_socket(const std::string &str);
@@ -360,22 +1027,40 @@ void log_to_socket(const std::string &str);
 
 std::string apply_color(const level &lvl, const std::string &str);
 
+/*
+ * The arguments of a record for the backlog, without their types:
+ * `capture` copies them from `args`, a tuple of references to them.
+ * There is one capture per list of argument types, not per call site.
+ */
+struct backlog_args
+{
+    void (*capture)(const level &lvl, std::string_view fmt,
+                    const void *args) = nullptr;
+    const void *args = nullptr;
+};
+
+template <typename... Args>
+void backlog_capture(const level &lvl, std::string_view fmt, const void *args);
+
+// The rest of log(): the record goes to the backlog or is formatted
+void log_slow(const level &lvl, std::string_view fmt, std::format_args args,
+              const backlog_args &backlog);
+
+/*
+ * Inlined at every call site: a relaxed load of the entry level, the
+ * lower of the log and backlog levels, a compare and a call. Filtered
+ * out records are the common case in hot loops, the backlog and the
+ * formatting are kept out of line, and not instantiated per call: the
+ * call site only builds the format arguments and the backlog_args.
+ */
 template <typename... Args>
-void log(const level &lvl, const std::string &fmt, Args &&...args)
+inline void log(const level &lvl, std::string_view fmt, Args &&...args)
 {
-    if (get_level() > lvl)
+    if (logger::entry_level.load(std::memory_order_relaxed) > lvl) [[likely]]
         return;
-    std::string formatted_string = log_to_string(lvl, fmt, args...);
-    if (get_flags() & static_cast<long unsigned int>(flags::color))
-        log_to_stdout(apply_color(lvl, formatted_string));
-    else
-        log_to_stdout(formatted_string);
-    if (is_file_open())
-        log_to_file(formatted_string);
-#ifdef OAK_USE_SOCKETS
-    if (logger::log_socket > 0)
-        log_to_socket(formatted_string);
-#endif
+    std::tuple<Args &...> refs(args...);
+    log_slow(lvl, fmt, std::make_format_args(args...),
+             {backlog_capture<Args...>, &refs});
 }
 
 #ifdef OAK_USE_SOCKETS
@@ -390,51 +1075,355 @@ set_socket(const std::string &addr, short unsigned int port,
 #endif
 
 template <typename... Args>
-inline void out(const std::string &fmt, Args &&...args)
+inline void out(std::string_view fmt, Args &&...args)
 {
     log(oak::level::output, fmt, args...);
 }
 
 template <typename... Args>
-inline void debug(const std::string &fmt, Args &&...args)
+inline void debug(std::string_view fmt, Args &&...args)
 {
     log(oak::level::debug, fmt, args...);
 }
 
 template <typename... Args>
-inline void info(const std::string &fmt, Args &&...args)
+inline void info(std::string_view fmt, Args &&...args)
 {
     log(oak::level::info, fmt, args...);
 }
 
 template <typename... Args>
-inline void warn(const std::string &fmt, Args &&...args)
+inline void warn(std::string_view fmt, Args &&...args)
 {
     log(oak::level::warn, fmt, args...);
 }
 
 template <typename... Args>
-inline void error(const std::string &fmt, Args &&...args)
+inline void error(std::string_view fmt, Args &&...args)
 {
     log(oak::level::error, fmt, args...);
 }
 
 template <typename... Args>
-inline void output(const std::string &fmt, Args &&...args)
+inline void output(std::string_view fmt, Args &&...args)
 {
     log(oak::level::output, fmt, args...);
 }
 
 template <typename... Args>
-inline void async(const level &lvl, const std::string &fmt, Args &&...args)
+inline void async(const level &lvl, std::string_view fmt, Args &&...args)
 {
-    (void) std::async([lvl, fmt, args...]() { log(lvl, fmt, args...); });
+    (void) std::async([lvl, fmt = std::string(fmt), args...]()
+                      { log(lvl, fmt, args...); });
 }
 
 void flush();
 
+/*
+ * An argument computed only when the record is formatted, that is when
+ * its level is enabled:
+ *     oak::debug("state {}", oak::lazy([&] { return dump_state(); }));
+ * The result is formatted with its own formatter and format spec. A
+ * record with a lazy argument is not kept in the backlog: its callable
+ * may hold references that do not outlive the call.
+ */
+template <typename F> struct lazy
+{
+    F fn;
+};
+
+template <typename F> lazy(F) -> lazy<F>;
+
+template <typename T> struct is_lazy : std::false_type
+{
+};
+
+template <typename F> struct is_lazy<lazy<F>> : std::true_type
+{
+};
+
+/*
+ * Binary data formatted as lowercase hex pairs:
+ *     oak::debug("payload {}", oak::hex(std::as_bytes(std::span(buf))));
+ */
+struct hex
+{
+    std::span<const std::byte> bytes;
+};
+
+// Writes the 2 * size hex digits of data to out, returns their end
+char *hex_encode(const std::byte *data, std::size_t size, char *out);
+
+/*
+ * Keeps the filtered out records of the calling thread from
+ * `lvl` up, the last `size` of them, with their arguments captured but
+ * not formatted. They are formatted and written before every error of
+ * the thread, or by dump_backlog(). Records with an oak::lazy argument
+ * are not kept. level::disabled turns it off.
+ */
+inline void set_backlog(const level &lvl, std::size_t size = 256)
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    logger::backlog_size.store(size, std::memory_order_relaxed);
+    logger::backlog_level.store(size > 0 ? lvl : level::disabled,
+                                std::memory_order_relaxed);
+    update_entry_level();
+}
+
+// Writes and clears the backlog of the calling thread
+void dump_backlog();
+
+// Copies an argument so that it outlives the call
+template <typename T> auto capture_value(const T &value)
+{
+    return value;
+}
+
+inline std::string capture_value(const char *value)
+{
+    return value;
+}
+
+inline std::string capture_value(char *value)
+{
+    return value;
+}
+
+template <std::size_t N> std::string capture_value(const char (&value)[N])
+{
+    return value;
+}
+
+inline std::string capture_value(std::string_view value)
+{
+    return std::string(value);
+}
+
+inline std::string capture_value(const hex &value)
+{
+    std::string text(value.bytes.size() * 2, '\0');
+    hex_encode(value.bytes.data(), value.bytes.size(), text.data());
+    return text;
+}
+
+// A record of the backlog, its arguments live in `storage`
+struct backlog_entry
+{
+    static constexpr std::size_t storage_size = 128;
+
+    level lvl = level::debug;
+    std::time_t when = 0;
+    std::string fmt;
+    std::string text; // formatted at capture if the arguments do not fit
+    void (*format)(std::string &out, std::string_view fmt,
+                   const void *args) = nullptr;
+    void (*destroy)(void *args) = nullptr;
+    alignas(std::max_align_t) unsigned char storage[storage_size];
+
+    void reset()
+    {
+        if (destroy)
+            destroy(storage);
+        format = nullptr;
+        destroy = nullptr;
+    }
+};
+
+// Ring of the last backlog records of a thread, slots are reused
+class backlog_ring
+{
+  public:
+    ~backlog_ring()
+    {
+        clear();
+    }
+
+    template <typename... Args>
+    void capture(const level &lvl, std::string_view fmt, Args &...args)
+    {
+        auto size = logger::backlog_size.load(std::memory_order_relaxed);
+        if (size == 0)
+            return;
+        if (entries.size() != size)
+        {
+            clear();
+            entries = std::vector<backlog_entry>(size);
+        }
+        // Counted once it is built, a format error leaves no blank slot;
+        // in a full ring the oldest record it replaced is lost then
+        bool full = count == entries.size();
+        auto &entry = entries[(head + count) % entries.size()];
+        entry.reset();
+        try
+        {
+            fill(entry, lvl, fmt, args...);
+        }
+        catch (...)
+        {
+            entry.reset();
+            if (full)
+            {
+                head = (head + 1) % entries.size();
+                count--;
+            }
+            throw;
+        }
+        if (full)
+            head = (head + 1) % entries.size();
+        else
+            count++;
+    }
+
+    // Calls f on every record, oldest first, and empties the ring
+    template <typename F> void drain(F &&f)
+    {
+        for (; count > 0; --count)
+        {
+            auto &entry = entries[head];
+            f(entry);
+            entry.reset();
+            head = (head + 1) % entries.size();
+        }
+        head = 0;
+    }
+
+    void clear()
+    {
+        for (auto &entry : entries)
+            entry.reset();
+        head = 0;
+        count = 0;
+    }
+
+    /*
+     * Allocates the ring and writes `bytes` into the strings of its
+     * slots, `advise` gets the new ring before it is written.
+     */
+    void reserve(std::size_t bytes, memory_advice advise = nullptr)
+    {
+        auto size = logger::backlog_size.load(std::memory_order_relaxed);
+        if (size == 0)
+            return;
+        if (entries.size() != size)
+        {
+            clear();
+            std::vector<backlog_entry> ring;
+            ring.reserve(size);
+            if (advise)
+                advise({ring.data(), size * sizeof(backlog_entry)});
+            ring.resize(size);
+            entries = std::move(ring);
+        }
+        for (auto &entry : entries)
+        {
+            entry.fmt.assign(bytes, '\0');
+            entry.fmt.clear();
+            entry.text.assign(bytes, '\0');
+            entry.text.clear();
+        }
+    }
+
+  private:
+    std::vector<backlog_entry> entries;
+    std::size_t head = 0;
+    std::size_t count = 0;
+
+    // Copies or formats the arguments of a record into its slot
+    template <typename... Args>
+    static void fill(backlog_entry &entry, const level &lvl,
+                     std::string_view fmt, Args &...args)
+    {
+        entry.lvl = lvl;
+        entry.when = std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now());
+        entry.fmt.assign(fmt);
+        using values = std::tuple<decltype(capture_value(args))...>;
+        if constexpr (sizeof(values) <= backlog_entry::storage_size
+                      && alignof(values) <= alignof(std::max_align_t))
+        {
+            new (entry.storage) values(capture_value(args)...);
+            entry.format =
+                [](std::string &out, std::string_view f, const void *p)
+            {
+                auto &v = *static_cast<values *>(const_cast<void *>(p));
+                std::apply([&out, f](auto &...a)
+                           { vformat_append(out, f, std::make_format_args(a...)); },
+                           v);
+            };
+            entry.destroy = [](void *p) { static_cast<values *>(p)->~values(); };
+        }
+        else
+        {
+            entry.text.clear();
+            vformat_append(entry.text, fmt, std::make_format_args(args...));
+        }
+    }
+};
+
+inline backlog_ring &thread_backlog()
+{
+    thread_local backlog_ring ring;
+    return ring;
+}
+
+template <typename... Args>
+void backlog_capture(const level &lvl, std::string_view fmt, const void *args)
+{
+    // A lazy callable may not outlive the call, see oak::lazy
+    if constexpr ((is_lazy<std::remove_cvref_t<Args>>::value || ...))
+        return;
+    else
+    {
+        try
+        {
+            std::apply([&](auto &...a)
+                       { thread_backlog().capture(lvl, fmt, a...); },
+                       *static_cast<const std::tuple<Args &...> *>(args));
+        }
+        catch (const std::exception &e)
+        {
+            // A bad format string, reported when the record is enabled
+        }
+    }
+}
+
 } // namespace oak
 
+template <typename F>
+struct std::formatter<oak::lazy<F>>
+    : std::formatter<std::remove_cvref_t<std::invoke_result_t<const F &>>>
+{
+    template <typename FormatContext>
+    auto format(const oak::lazy<F> &value, FormatContext &ctx) const
+    {
+        return std::formatter<
+            std::remove_cvref_t<std::invoke_result_t<const F &>>>::
+            format(value.fn(), ctx);
+    }
+};
+
+template <> struct std::formatter<oak::hex>
+{
+    constexpr auto parse(format_parse_context &ctx)
+    {
+        return ctx.begin();
+    }
+
+    template <typename FormatContext>
+    auto format(const oak::hex &value, FormatContext &ctx) const
+    {
+        char buf[512];
+        auto out = ctx.out();
+        for (std::size_t i = 0; i < value.bytes.size(); i += sizeof(buf) / 2)
+        {
+            auto n = std::min(sizeof(buf) / 2, value.bytes.size() - i);
+            auto end = oak::hex_encode(value.bytes.data() + i, n, buf);
+            out = std::copy(buf, end, out);
+        }
+        return out;
+    }
+};
+
 template <> struct std::formatter<oak::level>
 {
     constexpr auto parse(format_parse_context &ctx)
@@ -487,6 +1476,12 @@ template <> struct std::formatter<oak::flags>
             return format_to(ctx.out(), "pid");
         case oak::flags::tid:
             return format_to(ctx.out(), "tid");
+        case oak::flags::json:
+            return format_to(ctx.out(), "json");
+        case oak::flags::color:
+            return format_to(ctx.out(), "color");
+        case oak::flags::seq:
+            return format_to(ctx.out(), "seq");
         default:
             return format_to(ctx.out(), "unknown");
         }
@@ -26,110 +26,3423 @@
 
 #include "oak/oak.hpp"
 
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <new>
+#include <numeric>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utility>
+
+#ifdef OAK_USE_NUMA
+#include <numa.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define OAK_HAVE_CRC32_SSE42
+#endif
+
+/*
+ * USDT tracepoints, a nop unless a tracer is attached:
+ *     bpftrace -e 'usdt:./build/tests:oak:enqueue { @[arg0] = count(); }'
+ * Every probe passes the level, the size and the sequence number of the
+ * record, the sink probes also pass the destination.
+ */
+#if defined(OAK_USE_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define OAK_PROBE(name, lvl, size, seq)                                       \
+    DTRACE_PROBE3(oak, name, static_cast<int>(lvl), size, seq)
+#define OAK_PROBE_SINK(name, lvl, size, seq, dest)                            \
+    DTRACE_PROBE4(oak, name, static_cast<int>(lvl), size, seq,                \
+                  static_cast<int>(dest))
+#else
+#define OAK_PROBE(name, lvl, size, seq)                                       \
+    do                                                                         \
+    {                                                                          \
+    } while (0)
+#define OAK_PROBE_SINK(name, lvl, size, seq, dest)                            \
+    do                                                                         \
+    {                                                                          \
+    } while (0)
+#endif
+
 using namespace oak;
 
-long unsigned int oak::logger::flag_bits = 1;
-oak::level oak::logger::log_level = oak::level::warn;
-std::ofstream oak::logger::log_file;
-std::deque<queue_element> oak::logger::log_queue;
-std::mutex oak::logger::log_mutex;
-std::condition_variable oak::logger::log_cv;
-std::atomic<bool> oak::logger::close_writer = false;
-std::optional<std::jthread> oak::logger::writer_thread;
-#ifdef OAK_USE_SOCKETS
-int oak::logger::log_socket = -1;
+namespace
+{
+std::vector<oak::cpu_queue *> make_cpu_queues();
+} // namespace
+
+std::atomic<long unsigned int> oak::logger::flag_bits = 1;
+std::atomic<oak::level> oak::logger::log_level = oak::level::warn;
+std::atomic<std::uint64_t> oak::logger::sample_one_in = 0;
+std::atomic<oak::level> oak::logger::backlog_level = oak::level::disabled;
+std::atomic<oak::level> oak::logger::entry_level = oak::level::warn;
+std::atomic<std::size_t> oak::logger::backlog_size = 0;
+std::ofstream oak::logger::log_file;
+std::string oak::logger::log_file_path;
+std::atomic<oak::file_format> oak::logger::log_file_format =
+    oak::file_format::text;
+std::size_t oak::logger::index_records = 0;
+std::size_t oak::logger::index_bytes = 0;
+std::size_t oak::logger::search_segment_bytes = 0;
+std::size_t oak::logger::search_filter_bytes = 0;
+bool oak::logger::per_process_files = false;
+oak::record_queue oak::logger::log_queue;
+oak::record_queue oak::logger::urgent_queue;
+std::vector<std::unique_ptr<oak::producer_queue>> oak::logger::producers;
+std::size_t oak::logger::producers_size = 0;
+std::size_t oak::logger::producer_next = 0;
+std::size_t oak::logger::producer_quota = 0;
+std::size_t oak::logger::cpu_count =
+    static_cast<std::size_t>(std::max(1L, sysconf(_SC_NPROCESSORS_CONF)));
+std::vector<oak::cpu_queue *> oak::logger::cpu_queues = make_cpu_queues();
+bool oak::logger::cpu_queues_used = false;
+int oak::logger::writer_node = -1;
+bool oak::logger::node_writers = false;
+std::atomic<std::size_t> oak::logger::warm_records = 0;
+std::atomic<std::size_t> oak::logger::warm_bytes = 0;
+std::atomic<bool> oak::logger::warm_huge_pages = false;
+std::mutex oak::logger::log_mutex;
+std::mutex oak::logger::sink_mutex;
+std::vector<std::shared_ptr<oak::sink>> oak::logger::sinks;
+std::atomic<std::size_t> oak::logger::in_flight = 0;
+std::condition_variable oak::logger::log_cv;
+std::atomic<bool> oak::logger::close_writer = false;
+std::atomic<bool> oak::logger::writer_running = false;
+std::atomic<oak::write_mode> oak::logger::mode = oak::write_mode::automatic;
+std::optional<std::jthread> oak::logger::writer_thread;
+std::atomic<std::size_t> oak::logger::queue_capacity = 0;
+std::size_t oak::logger::queue_high_water = 0;
+std::atomic<std::uint64_t> oak::logger::sequence = 0;
+std::atomic<oak::ordering> oak::logger::order = oak::ordering::strict;
+bool oak::logger::urgent_flush = false;
+oak::level oak::logger::base_level = oak::level::warn;
+std::size_t oak::logger::overload_high = 0;
+std::size_t oak::logger::overload_low = 0;
+oak::overload_action oak::logger::overload_act =
+    oak::overload_action::raise_level;
+unsigned oak::logger::overload_sample = 10;
+unsigned oak::logger::overload_step = 0;
+std::chrono::milliseconds oak::logger::stats_interval{0};
+std::chrono::milliseconds oak::logger::shutdown_deadline{5000};
+std::string oak::logger::stats_file;
+bool oak::logger::stats_log = false;
+#ifdef OAK_USE_SOCKETS
+int oak::logger::log_socket = -1;
+#endif
+
+namespace
+{
+
+inline std::uint64_t now_ns()
+{
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+#ifdef OAK_USE_STATS
+
+/*
+ * Counters written by a single thread and read by any: the owner updates
+ * them with relaxed load + store, which is cheaper than a locked
+ * read-modify-write. A reset from another thread cannot store to the
+ * value, the owner would overwrite it with its own load: it moves a
+ * baseline instead, which get() subtracts. The value only grows, so it
+ * is never below the baseline. Read and reset under stats_mutex.
+ */
+struct counter
+{
+    std::atomic<std::uint64_t> value = 0;
+    std::uint64_t base = 0;
+
+    inline void add(std::uint64_t n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+    }
+
+    inline std::uint64_t get() const
+    {
+        return value.load(std::memory_order_relaxed) - base;
+    }
+
+    inline void reset()
+    {
+        base = value.load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Counters written by several threads: the writer, the callers that
+ * write directly and the node writers. Relaxed read-modify-writes, so
+ * that no update is lost, nor a reset.
+ */
+struct shared_counter
+{
+    std::atomic<std::uint64_t> value = 0;
+
+    inline void add(std::uint64_t n)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    inline void raise(std::uint64_t n)
+    {
+        auto old = get();
+        while (n > old && !value.compare_exchange_weak(
+                              old, n, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    inline std::uint64_t get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    inline void reset()
+    {
+        value.store(0, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * The maximum is a shared_counter whatever the owner: it does not add
+ * up, so it cannot be reset with a baseline, and its compare and swap
+ * only runs on a new maximum.
+ */
+template <typename Counter = counter> struct atomic_histogram
+{
+    std::array<Counter, histogram::buckets> counts;
+    Counter count;
+    Counter sum;
+    shared_counter max;
+
+    inline void add(std::uint64_t ns)
+    {
+        counts[histogram::bucket(ns)].add(1);
+        count.add(1);
+        sum.add(ns);
+        max.raise(ns);
+    }
+
+    inline void read(histogram &h) const
+    {
+        histogram tmp;
+        for (std::size_t i = 0; i < histogram::buckets; ++i)
+            tmp.counts[i] = counts[i].get();
+        tmp.count = count.get();
+        tmp.sum = sum.get();
+        tmp.max = max.get();
+        h.merge(tmp);
+    }
+
+    inline void reset()
+    {
+        for (auto &c : counts)
+            c.reset();
+        count.reset();
+        sum.reset();
+        max.reset();
+    }
+};
+
+// Producer side metrics of one thread
+struct thread_stats
+{
+    std::array<counter, num_levels> messages;
+    std::array<counter, num_levels> bytes;
+    counter drops;
+    counter direct_writes;
+    atomic_histogram<> enqueue_wait;
+
+    thread_stats();
+    ~thread_stats();
+
+    void read(stats_snapshot &snap) const
+    {
+        for (std::size_t i = 0; i < num_levels; ++i)
+        {
+            snap.messages[i] += messages[i].get();
+            snap.bytes[i] += bytes[i].get();
+        }
+        snap.drops += drops.get();
+        snap.direct_writes += direct_writes.get();
+        enqueue_wait.read(snap.enqueue_wait);
+    }
+
+    void reset()
+    {
+        for (std::size_t i = 0; i < num_levels; ++i)
+        {
+            messages[i].reset();
+            bytes[i].reset();
+        }
+        drops.reset();
+        direct_writes.reset();
+        enqueue_wait.reset();
+    }
+};
+
+// Sink side metrics, of every thread that writes to the sinks
+struct writer_stats
+{
+    atomic_histogram<shared_counter> writer_lag;
+    std::array<shared_counter, num_sinks> writes;
+    std::array<shared_counter, num_sinks> bytes;
+    std::array<shared_counter, num_sinks> errors;
+    std::array<atomic_histogram<shared_counter>, num_sinks> latency;
+};
+
+std::mutex stats_mutex;
+std::vector<thread_stats *> live_threads;
+stats_snapshot exited_threads; // totals of the threads already gone
+writer_stats writer_side;
+
+thread_stats::thread_stats()
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    live_threads.push_back(this);
+}
+
+thread_stats::~thread_stats()
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    read(exited_threads);
+    std::erase(live_threads, this);
+}
+
+thread_local thread_stats local_stats;
+
+#endif
+
+inline const char *color_code(const level &lvl)
+{
+    switch (lvl)
+    {
+    case level::debug:
+        return KCYN;
+    case level::info:
+        return KBLU;
+    case level::warn:
+        return KYEL;
+    case level::error:
+        return KRED;
+    case level::output:
+        return KGRN;
+    default:
+        return "";
+    }
+}
+
+/*
+ * Writes the whole message with write_some, which has the semantics of
+ * POSIX write: partial writes are continued, EINTR and EAGAIN are
+ * retried with a short backoff.
+ */
+template <typename F> bool write_fully(F &&write_some, std::string_view message)
+{
+    constexpr int max_retries = 8;
+    int retries = 0;
+    std::size_t done = 0;
+    while (done < message.size())
+    {
+        auto n = write_some(message.data() + done, message.size() - done);
+        if (n > 0)
+        {
+            done += static_cast<std::size_t>(n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+            && retries < max_retries)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(50)
+                                        * (1 << retries));
+            retries++;
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+inline frame_header make_frame(std::string_view message)
+{
+    frame_header frame;
+    frame.size = static_cast<std::uint32_t>(message.size());
+    frame.crc = oak::crc32c(message.data(), message.size(),
+                            oak::crc32c(&frame.size, sizeof(frame.size)));
+    return frame;
+}
+
+/*
+ * Writes a record to a log file, after its frame in a framed file.
+ * Returns the bytes written.
+ */
+inline std::size_t write_file_record(std::ofstream &file,
+                                     std::string_view message)
+{
+    std::size_t size = message.size();
+    if (logger::log_file_format.load(std::memory_order_relaxed)
+        == file_format::framed)
+    {
+        auto frame = make_frame(message);
+        file.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
+        size += sizeof(frame);
+    }
+    file << message;
+    return size;
+}
+
+/*
+ * The sidecar index of a log file, written by its writer only: sink_mutex
+ * must be held for the one of the log file. The intervals are taken from
+ * set_file_index() when it is opened.
+ */
+struct file_index_state
+{
+    int fd = -1;
+    std::uint64_t offset = 0; // of the next record in the log file
+    std::size_t records = 0;  // written since the last entry
+    std::size_t bytes = 0;
+    std::size_t every_records = 0;
+    std::size_t every_bytes = 0;
+};
+file_index_state file_index;
+
+void close_file_index(file_index_state &index)
+{
+    if (index.fd >= 0)
+        close(index.fd);
+    index = {};
+}
+
+/*
+ * Opens the index of the log file at `path` if set_file_index() asks
+ * for one. A torn entry and the entries past the end of the log file,
+ * cut by a recovery, are dropped.
+ */
+void open_file_index(file_index_state &index, const std::string &path)
+{
+    close_file_index(index);
+    if (logger::index_records == 0 && logger::index_bytes == 0)
+        return;
+    index.every_records = logger::index_records;
+    index.every_bytes = logger::index_bytes;
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    index.offset = ec ? 0 : size;
+    auto index_path = path + ".idx";
+    int fd = open(index_path.c_str(),
+                  O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    auto entries =
+        static_cast<std::uint64_t>(st.st_size) / sizeof(index_entry);
+    for (; entries > 0; --entries)
+    {
+        index_entry entry;
+        auto at = static_cast<off_t>((entries - 1) * sizeof(entry));
+        if (pread(fd, &entry, sizeof(entry), at)
+                != static_cast<ssize_t>(sizeof(entry))
+            || entry.offset < index.offset)
+            break;
+    }
+    if (ftruncate(fd, static_cast<off_t>(entries * sizeof(index_entry))) < 0)
+    {
+        close(fd);
+        return;
+    }
+    index.fd = fd;
+}
+
+// Adds the record about to be written at the end of the log file
+inline void index_record(file_index_state &index, std::uint64_t seq,
+                         std::size_t size)
+{
+    if (index.fd < 0)
+        return;
+    bool due = index.records == 0
+               || (index.every_records > 0
+                   && index.records >= index.every_records)
+               || (index.every_bytes > 0 && index.bytes >= index.every_bytes);
+    if (due)
+    {
+        index_entry entry;
+        entry.time_ns = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count());
+        entry.seq = seq;
+        entry.offset = index.offset;
+        write_fully([fd = index.fd](const char *data, std::size_t n)
+                    { return write(fd, data, n); },
+                    std::string_view(reinterpret_cast<const char *>(&entry),
+                                     sizeof(entry)));
+        index.records = 0;
+        index.bytes = 0;
+    }
+    index.records++;
+    index.bytes += size;
+    index.offset += size;
+}
+
+// Letters, digits, _-. and the bytes of UTF-8 sequences
+inline bool token_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+           || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.'
+           || static_cast<unsigned char>(c) >= 0x80;
+}
+
+template <typename F> void for_each_token(std::string_view text, F &&f)
+{
+    std::size_t at = 0;
+    while (at < text.size())
+    {
+        while (at < text.size() && !token_char(text[at]))
+            at++;
+        auto start = at;
+        while (at < text.size() && token_char(text[at]))
+            at++;
+        if (at > start)
+            f(text.substr(start, at - start));
+    }
+}
+
+constexpr std::uint32_t bloom_hashes = 4;
+
+// The `hashes` bits of a token, by double hashing of FNV-1a
+template <typename F>
+void for_each_bloom_bit(std::string_view token, std::uint64_t bits,
+                        std::uint32_t hashes, F &&f)
+{
+    std::uint64_t h = 0xcbf29ce484222325;
+    for (char c : token)
+    {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001b3;
+    }
+    auto step = ((h ^ (h >> 31)) * 0x94d049bb133111eb) | 1;
+    for (std::uint32_t i = 0; i < hashes; ++i)
+        f((h + i * step) & (bits - 1));
+}
+
+// The bloom filter of the open segment of a log file, as file_index_state
+struct search_index_state
+{
+    int fd = -1;
+    std::uint64_t begin = 0;  // of the segment in the log file
+    std::uint64_t offset = 0; // of the next record
+    std::size_t segment_bytes = 0;
+    std::vector<std::uint64_t> filter;
+};
+search_index_state search_index;
+
+inline std::uint64_t filter_bits(const search_index_state &search)
+{
+    return search.filter.size() * 64;
+}
+
+// Appends the open segment to the sidecar and starts the next one
+void write_search_segment(search_index_state &search)
+{
+    if (search.fd < 0 || search.offset == search.begin)
+        return;
+    bloom_header header;
+    header.hashes = bloom_hashes;
+    header.begin = search.begin;
+    header.end = search.offset;
+    header.bits = filter_bits(search);
+    std::string segment(reinterpret_cast<const char *>(&header),
+                        sizeof(header));
+    segment.append(reinterpret_cast<const char *>(search.filter.data()),
+                   search.filter.size() * sizeof(std::uint64_t));
+    write_fully([fd = search.fd](const char *data, std::size_t n)
+                { return write(fd, data, n); },
+                segment);
+    std::fill(search.filter.begin(), search.filter.end(), 0);
+    search.begin = search.offset;
+}
+
+void close_search_index(search_index_state &search)
+{
+    write_search_segment(search);
+    if (search.fd >= 0)
+        close(search.fd);
+    search = {};
+}
+
+/*
+ * Opens the sidecar of the log file at `path` if set_search_index()
+ * asks for one, dropping the open segment of the previous file. A torn
+ * segment and the segments past the end of the log file are dropped.
+ */
+void open_search_index(search_index_state &search, const std::string &path)
+{
+    if (search.fd >= 0)
+        close(search.fd);
+    search = {};
+    if (logger::search_segment_bytes == 0)
+        return;
+    search.segment_bytes = logger::search_segment_bytes;
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    search.begin = search.offset = ec ? 0 : size;
+    auto bytes = logger::search_filter_bytes > 0
+                     ? logger::search_filter_bytes
+                     : logger::search_segment_bytes / 16;
+    search.filter.resize(std::bit_ceil(std::max<std::size_t>(
+                             bytes, sizeof(std::uint64_t)))
+                         / sizeof(std::uint64_t));
+
+    auto sidecar = path + ".bloom";
+    int fd = open(sidecar.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                  0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    std::uint64_t kept = 0;
+    while (kept < static_cast<std::uint64_t>(st.st_size))
+    {
+        bloom_header header;
+        if (pread(fd, &header, sizeof(header), static_cast<off_t>(kept))
+                != static_cast<ssize_t>(sizeof(header))
+            || header.magic != bloom_header::magic_value
+            || header.end > search.begin
+            || kept + sizeof(header) + header.bits / 8
+                   > static_cast<std::uint64_t>(st.st_size))
+            break;
+        kept += sizeof(header) + header.bits / 8;
+    }
+    if (ftruncate(fd, static_cast<off_t>(kept)) < 0)
+    {
+        close(fd);
+        return;
+    }
+    search.fd = fd;
+}
+
+// Adds the tokens of a record written at the end of the log file
+inline void search_record(search_index_state &search,
+                          std::string_view message, std::size_t size)
+{
+    if (search.fd < 0)
+        return;
+    auto bits = filter_bits(search);
+    auto *filter = search.filter.data();
+    for_each_token(message,
+                   [bits, filter](std::string_view token)
+                   {
+                       for_each_bloom_bit(
+                           token, bits, bloom_hashes,
+                           [filter](std::uint64_t bit)
+                           { filter[bit / 64] |= 1ull << (bit % 64); });
+                   });
+    search.offset += size;
+    if (search.offset - search.begin >= search.segment_bytes)
+        write_search_segment(search);
+}
+
+// A log file with its sidecars: the one of set_file() or of a node writer
+struct file_target
+{
+    std::ofstream &file;
+    file_index_state &index;
+    search_index_state &search;
+};
+
+/*
+ * Writes to one sink and records its latency and errors. The file
+ * records go to `target`, the log file if null.
+ */
+inline void write_sink(const destination &d, std::string_view message,
+                       const level &lvl = level::output,
+                       std::uint64_t seq = 0, bool color = false,
+                       const file_target *target = nullptr)
+{
+    OAK_PROBE_SINK(write_start, lvl, message.size(), seq, d);
+#ifdef OAK_USE_STATS
+    auto start = now_ns();
+#endif
+    bool ok = true;
+    switch (d)
+    {
+    case oak::destination::std_out:
+        if (color)
+            std::cout << color_code(lvl) << message << RST;
+        else
+            std::cout << message;
+        ok = std::cout.good();
+        break;
+    case oak::destination::file:
+    {
+        file_target log_file = {logger::log_file, file_index, search_index};
+        auto &t = target ? *target : log_file;
+        auto written = write_file_record(t.file, message);
+        index_record(t.index, seq, written);
+        search_record(t.search, message, written);
+        ok = t.file.good();
+        break;
+    }
+    case oak::destination::socket:
+#ifdef OAK_USE_SOCKETS
+        ok = write_fully([](const char *data, std::size_t size)
+                         { return write(logger::log_socket, data, size); },
+                         message);
+#endif
+        break;
+    case oak::destination::custom:
+        for (auto &s : logger::sinks)
+            ok = write_fully([&s](const char *data, std::size_t size)
+                             { return s->write(data, size); },
+                             message)
+                 && ok;
+        break;
+    default:
+        return;
+    }
+    OAK_PROBE_SINK(write_end, lvl, message.size(), seq, d);
+#ifdef OAK_USE_STATS
+    auto i = static_cast<std::size_t>(d);
+    writer_side.latency[i].add(now_ns() - start);
+    writer_side.writes[i].add(1);
+    writer_side.bytes[i].add(message.size());
+    if (!ok)
+        writer_side.errors[i].add(1);
+#else
+    (void) ok;
+#endif
+}
+
+#ifdef OAK_USE_NUMA
+bool numa_enabled()
+{
+    static bool enabled = numa_available() >= 0;
+    return enabled;
+}
+#endif
+
+int node_of_cpu(std::size_t cpu)
+{
+#ifdef OAK_USE_NUMA
+    if (numa_enabled())
+        return std::max(0, numa_node_of_cpu(static_cast<int>(cpu)));
+#endif
+    (void) cpu;
+    return 0;
+}
+
+// Moves the calling thread to the CPUs of a node, -1 for any CPU
+void run_on_node(int node)
+{
+#ifdef OAK_USE_NUMA
+    if (numa_enabled() && node < numa_nodes())
+        numa_run_on_node(node);
+#endif
+    (void) node;
+}
+
+// Runs f on a thread of `node`, the pages it touches first are allocated
+// there. Inline with a single node.
+template <typename F> void on_node(int node, F &&f)
+{
+    if (numa_nodes() <= 1)
+    {
+        f();
+        return;
+    }
+    std::jthread thread(
+        [node, &f]
+        {
+            run_on_node(node);
+            f();
+        });
+}
+
+// Asks for transparent huge pages on the whole pages of a range
+void advise_huge_pages(std::pair<void *, std::size_t> range)
+{
+#ifdef MADV_HUGEPAGE
+    auto page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto begin = reinterpret_cast<std::uintptr_t>(range.first);
+    auto end = begin + range.second;
+    begin = (begin + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (begin < end)
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+#else
+    (void) range;
+#endif
+}
+
+/*
+ * With more than one node, every CPU queue is allocated on the node of
+ * its CPU. Its slots and strings are allocated by the producers that
+ * run there, the first touch keeps them local too.
+ */
+std::vector<cpu_queue *> make_cpu_queues()
+{
+    std::vector<cpu_queue *> queues(logger::cpu_count);
+    for (std::size_t cpu = 0; cpu < queues.size(); ++cpu)
+    {
+        int node = node_of_cpu(cpu);
+        void *memory = nullptr;
+#ifdef OAK_USE_NUMA
+        if (numa_enabled() && numa_max_node() > 0)
+            memory = numa_alloc_onnode(sizeof(cpu_queue), node);
+#endif
+        queues[cpu] = memory ? new (memory) cpu_queue() : new cpu_queue();
+        queues[cpu]->node = node;
+    }
+    return queues;
+}
+
+// A writer for the CPU queues of one NUMA node, see set_node_writers()
+struct node_writer
+{
+    int node = 0;
+    std::vector<std::size_t> cpus;
+    std::ofstream file;
+    file_index_state index;
+    search_index_state search;
+    std::string path;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<bool> sleeping = false;
+    std::atomic<std::size_t> in_flight = 0;
+    std::optional<std::jthread> thread;
+};
+
+// One per node once started, never freed: producers may still wake one
+std::vector<std::unique_ptr<node_writer>> node_writers;
+std::atomic<bool> node_writers_running = false;
+
+/*
+ * Records in the CPU queues, log_mutex must be held. It reads every CPU
+ * queue, so only the writer and the callers of queue_size() sum them:
+ * producers see queued().
+ */
+inline std::size_t cpu_pending()
+{
+    std::size_t size = 0;
+    if (logger::cpu_queues_used)
+        for (auto *q : logger::cpu_queues)
+            size += q->size.load(std::memory_order_relaxed);
+    return size;
+}
+
+// The CPU queues left to the main writer, none if the nodes have theirs
+inline std::size_t writer_cpu_pending()
+{
+    return node_writers_running.load() ? 0 : cpu_pending();
+}
+
+// Records in the shared queues or being written, log_mutex must be held
+inline std::size_t queued()
+{
+    std::size_t size = logger::log_queue.size() + logger::urgent_queue.size()
+                       + logger::producers_size + logger::in_flight.load();
+    for (auto &w : node_writers)
+        size += w->in_flight.load();
+    return size;
+}
+
+// Records queued or being written, log_mutex must be held
+inline std::size_t pending()
+{
+    return queued() + cpu_pending();
+}
+
+/*
+ * Set by the writer before it checks the queues and waits. A producer
+ * of a CPU queue reads it after its push, without log_mutex: either it
+ * sees it and wakes the writer, or the writer sees the record. Both
+ * sides put a seq_cst fence between their store and their load, else
+ * each load may pass its own store and both miss the other.
+ */
+std::atomic<bool> writer_sleeping = false;
+
+// Set when a thread starts being throttled, log_mutex must be held
+bool throttle_pending = false;
+
+// Set when a record enters the urgent lane, read by the writer
+std::atomic<bool> urgent_pending = false;
+
+// What the writer did with the records since stop_writer() was called
+struct shutdown_counts
+{
+    std::atomic<std::size_t> drained = 0;
+    std::atomic<std::size_t> discarded = 0;
+    std::atomic<bool> deadline_expired = false;
+
+    void reset()
+    {
+        drained = 0;
+        discarded = 0;
+        deadline_expired = false;
+    }
+};
+
+// Shutdown state, set by stop_writer() before it wakes the writer
+std::atomic<bool> closing = false;
+std::atomic<std::size_t> rejected = 0;
+std::chrono::steady_clock::time_point shutdown_until;
+shutdown_counts last_shutdown; // atomic, an abandoned writer may still run
+
+/*
+ * How long past the deadline stop_writer() waits for the writer to
+ * return, for the final sync of the sinks. A writer blocked in a sink
+ * longer than that is abandoned.
+ */
+constexpr auto writer_grace = std::chrono::seconds(1);
+
+// Set when the writer returns, stop_writer() waits on it
+std::mutex writer_done_mutex;
+std::condition_variable writer_done_cv;
+bool writer_done = false;
+
+// Requested on the writer thread when stop_writer() abandons it
+thread_local std::stop_token writer_token;
+
+/*
+ * True in a writer that stop_writer() abandoned: it counted the records
+ * of that writer as discarded, and another writer may run by now. The
+ * writer then leaves the shared state alone and returns.
+ */
+inline bool writer_abandoned()
+{
+    return writer_token.stop_requested();
+}
+
+inline bool past_shutdown_deadline()
+{
+    return logger::close_writer.load()
+           && std::chrono::steady_clock::now() >= shutdown_until;
+}
+
+// Flushes every sink and syncs the log file to disk
+void sync_sinks()
+{
+    std::lock_guard<std::mutex> lock(logger::sink_mutex);
+    std::cout << std::flush;
+    if (logger::log_file.is_open())
+    {
+        logger::log_file << std::flush;
+        // Any descriptor of the file syncs its data
+        int fd = open(logger::log_file_path.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    write_search_segment(search_index);
+    for (auto &s : logger::sinks)
+        s->flush();
+}
+
+// Writes a message to every open destination
+inline void write_all(std::string_view message, const level &lvl,
+                      bool color, std::uint64_t seq = 0)
+{
+    write_sink(oak::destination::std_out, message, lvl, seq, color);
+    if (logger::log_file.is_open())
+        write_sink(oak::destination::file, message, lvl, seq);
+#ifdef OAK_USE_SOCKETS
+    if (logger::log_socket > 0)
+        write_sink(oak::destination::socket, message, lvl, seq);
+#endif
+    if (!logger::sinks.empty())
+        write_sink(oak::destination::custom, message, lvl, seq);
+}
+
+// Writes a record from the calling thread, sink_mutex must be held
+void write_record(std::string_view message, const destination &d,
+                  const level &lvl, bool color, std::uint64_t seq)
+{
+    OAK_PROBE(direct, lvl, message.size(), seq);
+    if (d == destination::all)
+        write_all(message, lvl, color, seq);
+    else
+        write_sink(d, message, lvl, seq);
+    // Each record reaches its sink with a single write
+    std::cout << std::flush;
+    if (logger::log_file.is_open())
+        logger::log_file << std::flush;
+#ifdef OAK_USE_STATS
+    auto i = static_cast<std::size_t>(lvl);
+    local_stats.messages[i].add(1);
+    local_stats.bytes[i].add(message.size());
+    local_stats.direct_writes.add(1);
+#endif
+}
+
+// sink_mutex keeps the records of different threads apart
+void write_direct(std::string_view message, const destination &d,
+                  const level &lvl, bool color, std::uint64_t seq)
+{
+    std::lock_guard<std::mutex> sinks(logger::sink_mutex);
+    if (seq == 0)
+        seq = ++logger::sequence;
+    write_record(message, d, lvl, color, seq);
+}
+
+/*
+ * Writes a record from the calling thread if no one else is writing and
+ * nothing is queued: the queued records are older and the writer must
+ * write them first, so the sequence numbers stay in order.
+ */
+bool try_write_direct(std::string_view message, const destination &d,
+                      const level &lvl, bool color, std::uint64_t seq)
+{
+    std::unique_lock<std::mutex> sinks(logger::sink_mutex, std::try_to_lock);
+    if (!sinks.owns_lock())
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        if (pending() > 0 || logger::close_writer.load())
+            return false;
+        if (seq == 0)
+            seq = ++logger::sequence;
+    }
+    write_record(message, d, lvl, color, seq);
+    return true;
+}
+
+// State of the periodic export, owned by the writer thread
+struct stats_exporter
+{
+    std::chrono::steady_clock::time_point next = {};
+    std::chrono::steady_clock::time_point last = {};
+    std::chrono::milliseconds armed{0}; // the interval of `next`
+    std::uint64_t last_messages = 0;
+
+    void run(const std::chrono::milliseconds &interval)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (interval != armed)
+        {
+            armed = interval;
+            next = {};
+        }
+        if (interval.count() <= 0)
+        {
+            next = {};
+            return;
+        }
+        if (next == std::chrono::steady_clock::time_point{})
+        {
+            next = now + interval;
+            last = now;
+            last_messages = 0;
+            for (auto m : oak::stats().messages)
+                last_messages += m;
+            return;
+        }
+        if (now < next)
+            return;
+
+        std::string file;
+        bool log_line;
+        {
+            std::lock_guard<std::mutex> lock(logger::log_mutex);
+            file = logger::stats_file;
+            log_line = logger::stats_log;
+        }
+
+        auto snap = oak::stats();
+        std::uint64_t messages = 0;
+        for (auto m : snap.messages)
+            messages += m;
+        double seconds = std::chrono::duration<double>(now - last).count();
+        double rate = seconds > 0 ? static_cast<double>(messages
+                                                        - last_messages)
+                                        / seconds
+                                  : 0;
+        last_messages = messages;
+        last = now;
+        next = now + interval;
+
+        if (!file.empty())
+        {
+            // Written aside and renamed, the collector never sees a
+            // partial file
+            std::string tmp = file + ".tmp";
+            std::ofstream out(tmp, std::ios::trunc);
+            out << to_prometheus(snap);
+            out << "# HELP oak_messages_per_second Messages enqueued per "
+                   "second over the last interval.\n"
+                << "# TYPE oak_messages_per_second gauge\n"
+                << "oak_messages_per_second " << rate << "\n";
+            out.close();
+            if (out.good())
+                std::filesystem::rename(tmp, file);
+        }
+
+        if (log_line)
+        {
+            auto &std_out = snap.sinks[static_cast<std::size_t>(
+                oak::destination::std_out)];
+            auto &log_file =
+                snap.sinks[static_cast<std::size_t>(oak::destination::file)];
+            std::string message = oak::log_to_string(
+                oak::level::info,
+                "oak stats: messages={} rate={:.1f}/s drops={} "
+                "queue_depth={} high_water={} writer_lag_p99={}ns "
+                "stdout_p99={}ns file_p99={}ns sink_errors={}",
+                messages, rate, snap.drops, snap.queue_depth,
+                snap.queue_high_water, snap.writer_lag.percentile(99),
+                std_out.latency.percentile(99),
+                log_file.latency.percentile(99),
+                std_out.errors + log_file.errors);
+            std::lock_guard<std::mutex> lock(logger::sink_mutex);
+            write_all(message, oak::level::info, false);
+        }
+    }
+};
+
+// Formatted once per thread, the id of a thread never changes
+const std::string &thread_id_string()
+{
+    thread_local std::string tid = []
+    {
+        std::ostringstream oss;
+        oss << std::this_thread::get_id();
+        return oss.str();
+    }();
+    return tid;
+}
+
+// Reused by every record of the thread, it keeps its capacity
+std::string &thread_buffer()
+{
+    thread_local std::string buffer;
+    return buffer;
+}
+
+// True for about 1 in `one_in` calls, xorshift on a per-thread state
+bool sample_keep(std::uint64_t one_in)
+{
+    thread_local std::uint64_t state =
+        std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state % one_in == 0;
+}
+
+// Steps the records below warn can still be degraded by
+unsigned max_overload_steps()
+{
+    auto base = static_cast<unsigned>(logger::base_level);
+    auto warn = static_cast<unsigned>(level::warn);
+    if (base >= warn)
+        return 0;
+    if (logger::overload_act == overload_action::raise_level)
+        return warn - base;
+    return 2;
+}
+
+/*
+ * Publishes the effective level and the sampling of the current step,
+ * log_mutex must be held. The call sites only ever read the atomics.
+ */
+void apply_overload_step()
+{
+    logger::overload_step =
+        std::min(logger::overload_step, max_overload_steps());
+    auto step = logger::overload_step;
+    auto lvl = logger::base_level;
+    std::uint64_t one_in = 0;
+    if (step > 0 && logger::overload_act == overload_action::raise_level)
+        lvl = static_cast<level>(static_cast<unsigned>(lvl) + step);
+    else if (step > 0 && logger::overload_sample > 1)
+    {
+        one_in = logger::overload_sample;
+        if (step > 1)
+            one_in *= logger::overload_sample;
+    }
+    logger::log_level.store(lvl, std::memory_order_relaxed);
+    logger::sample_one_in.store(one_in, std::memory_order_relaxed);
+    update_entry_level();
+}
+
+// Queues a record of oak itself as a warn, log_mutex must be held
+void queue_notice(std::string message)
+{
+    bool urgent =
+        logger::order.load(std::memory_order_relaxed) == ordering::priority;
+    auto &slot =
+        urgent ? logger::urgent_queue.push() : logger::log_queue.push();
+    slot.message = std::move(message);
+    slot.dest = destination::all;
+    slot.lvl = level::warn;
+    slot.color = get_flags() & static_cast<long unsigned int>(flags::color);
+#ifdef OAK_USE_STATS
+    slot.enqueue_ns = now_ns();
+#else
+    slot.enqueue_ns = 0;
+#endif
+    slot.seq = ++logger::sequence;
+    if (urgent)
+        urgent_pending.store(true, std::memory_order_relaxed);
+}
+
+// Logs a change of step of the controller, log_mutex must be held
+void queue_overload_notice(std::size_t depth, bool raised)
+{
+    auto one_in = logger::sample_one_in.load(std::memory_order_relaxed);
+    queue_notice(log_to_string(
+        level::warn,
+        "oak overload {}: queue_depth={} high={} low={} level={} "
+        "sampling=1/{}",
+        raised ? "raised" : "cleared", depth, logger::overload_high,
+        logger::overload_low, level_name(get_level()),
+        one_in > 0 ? one_in : 1));
+}
+
+/*
+ * Moves the overload controller by the queue depth, log_mutex must be
+ * held: a step up at every multiple of the high watermark, back to no
+ * degradation at the low one. Called by the producers as the queue
+ * grows and by the writer as it drains.
+ */
+void update_overload(std::size_t depth)
+{
+    if (logger::overload_high == 0) [[likely]]
+        return;
+    auto step = logger::overload_step;
+    if (depth >= logger::overload_high)
+        step = std::max(step, static_cast<unsigned>(std::min<std::size_t>(
+                                  depth / logger::overload_high, 2)));
+    else if (depth <= logger::overload_low)
+        step = 0;
+    step = std::min(step, max_overload_steps());
+    if (step == logger::overload_step)
+        return;
+    bool raised = step > logger::overload_step;
+    logger::overload_step = step;
+    apply_overload_step();
+    queue_overload_notice(depth, raised);
+}
+
+// Moves the front record of `from` to `to`, the strings are swapped
+// so that both slots keep their memory, or copied
+void move_record(record_queue &from, record_queue &to, bool copy = false)
+{
+    auto &src = from.front();
+    auto &dst = to.push();
+    if (copy)
+        dst.message.assign(src.message);
+    else
+        std::swap(dst.message, src.message);
+    dst.dest = src.dest;
+    dst.lvl = src.lvl;
+    dst.color = src.color;
+    dst.enqueue_ns = src.enqueue_ns;
+    dst.seq = src.seq;
+    from.pop_front();
+}
+
+// Bytes taken from each thread per round of fair ordering
+constexpr std::size_t fair_quantum = 4096;
+
+// Marks the queue of a thread for removal once the thread is gone
+struct producer_handle
+{
+    producer_queue *queue = nullptr;
+
+    ~producer_handle()
+    {
+        if (queue == nullptr)
+            return;
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        queue->exited = true;
+    }
+};
+
+thread_local producer_handle local_producer;
+
+// The queue of the calling thread, log_mutex must be held
+producer_queue &thread_producer()
+{
+    if (local_producer.queue == nullptr)
+    {
+        auto &p = logger::producers.emplace_back(
+            std::make_unique<producer_queue>());
+        p->tid = thread_id_string();
+        local_producer.queue = p.get();
+    }
+    return *local_producer.queue;
+}
+
+/*
+ * Charges a record to the quota of its thread, false if it is over the
+ * quota of the current one second window. log_mutex must be held.
+ */
+bool charge_quota(producer_queue &p, std::size_t size)
+{
+    if (logger::producer_quota == 0)
+        return true;
+    auto now = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+    if (now - p.window_start >= 1'000'000'000)
+    {
+        p.window_start = now;
+        p.window_bytes = 0;
+    }
+    if (p.window_bytes + size > logger::producer_quota)
+    {
+        if (p.throttled++ == 0)
+            throttle_pending = true;
+        p.throttled_bytes += size;
+        return false;
+    }
+    p.window_bytes += size;
+    return true;
+}
+
+// Empties the producer queues, log_mutex must be held
+std::size_t clear_producers()
+{
+    for (auto &p : logger::producers)
+        p->records.clear();
+    return std::exchange(logger::producers_size, 0);
+}
+
+/*
+ * One round of deficit round robin over the producer queues: every
+ * thread with records gets fair_quantum more bytes of credit and moves
+ * the records its credit covers to log_queue, along with the notice of
+ * its throttled records. log_mutex must be held.
+ */
+void schedule_fair()
+{
+    auto &producers = logger::producers;
+    for (std::size_t n = 0; n < producers.size(); ++n)
+    {
+        auto &p = *producers[(logger::producer_next + n) % producers.size()];
+        if (p.throttled > 0)
+        {
+            queue_notice(log_to_string(
+                level::warn,
+                "oak throttled: tid={} dropped={} bytes={} quota={}B/s",
+                p.tid, p.throttled, p.throttled_bytes,
+                logger::producer_quota));
+            p.throttled = 0;
+            p.throttled_bytes = 0;
+        }
+        if (p.records.empty())
+        {
+            p.deficit = 0;
+            continue;
+        }
+        p.deficit += fair_quantum;
+        while (!p.records.empty()
+               && p.records.front().message.size() <= p.deficit)
+        {
+            p.deficit -= p.records.front().message.size();
+            move_record(p.records, logger::log_queue);
+            logger::producers_size--;
+        }
+        if (p.records.empty())
+            p.deficit = 0;
+    }
+    throttle_pending = false;
+    std::erase_if(producers, [](const auto &p)
+                  { return p->exited && p->records.empty(); });
+    logger::producer_next =
+        producers.empty() ? 0 : (logger::producer_next + 1) % producers.size();
+}
+
+// The writer's half of a swapped ring, as large as warmup() asked for
+void keep_warm(record_queue &ring)
+{
+    auto records = logger::warm_records.load(std::memory_order_relaxed);
+    if (ring.capacity() < records)
+        ring.reserve(records,
+                     logger::warm_bytes.load(std::memory_order_relaxed),
+                     logger::warm_huge_pages.load(std::memory_order_relaxed)
+                         ? advise_huge_pages
+                         : nullptr);
+}
+
+// Held for one push or one swap, a preempted holder is waited with yield
+void lock_cpu_queue(cpu_queue &q)
+{
+    while (q.lock.test_and_set(std::memory_order_acquire))
+        for (int spins = 0; q.lock.test(std::memory_order_relaxed); ++spins)
+            if (spins >= 64)
+                std::this_thread::yield();
+}
+
+// The CPU queue of the calling thread, where it runs right now
+cpu_queue &current_cpu_queue()
+{
+    std::size_t cpu =
+        std::hash<std::thread::id>{}(std::this_thread::get_id());
+#ifdef __linux__
+    // From the vDSO or rseq area, no system call
+    int id = sched_getcpu();
+    if (id >= 0)
+        cpu = static_cast<std::size_t>(id);
+#endif
+    return *logger::cpu_queues[cpu % logger::cpu_count];
+}
+
+/*
+ * Queues a record on the queue of the current CPU without log_mutex,
+ * nullptr if that queue is full. The thread may move to another CPU
+ * before the push, the spinlock keeps the queue consistent anyway.
+ *
+ * No shared counter is touched: the record is stamped with the steady
+ * clock under the lock, so every queue is in time order, and the drain
+ * merges the queues on (time, cpu) and numbers the records then. The
+ * stamp of a thread strictly increases and the drain takes its queues
+ * at once, the records of a thread stay in order when it moves to
+ * another CPU. The enqueue and drop probes of a record not numbered
+ * yet pass 0.
+ */
+cpu_queue *push_cpu(std::string_view str, const destination &d,
+                    const level &lvl, bool color, std::uint64_t seq)
+{
+    thread_local std::uint64_t last_ns = 0;
+    auto capacity = logger::queue_capacity.load(std::memory_order_relaxed);
+    auto &q = current_cpu_queue();
+    lock_cpu_queue(q);
+    last_ns = std::max(now_ns(), last_ns + 1);
+    if (capacity > 0 && q.records.size() >= capacity)
+    {
+        q.lock.clear(std::memory_order_release);
+        OAK_PROBE(drop, lvl, str.size(), seq);
+        return nullptr;
+    }
+    OAK_PROBE(enqueue, lvl, str.size(), seq);
+    auto &slot = q.records.push();
+    slot.message.assign(str);
+    slot.dest = d;
+    slot.lvl = lvl;
+    slot.color = color;
+    slot.enqueue_ns = last_ns;
+    slot.seq = seq;
+    q.size.store(q.records.size(), std::memory_order_relaxed);
+    q.lock.clear(std::memory_order_release);
+    return &q;
+}
+
+/*
+ * Takes the records of a set of CPU queues, each swapped with the spare
+ * of the queue, and merges them into a queue on (time, cpu): a k-way
+ * merge over the fronts. The records without a sequence number get one
+ * here, in merge order. The strings are copied rather than swapped and
+ * both rings stay with their queue, the memory of a CPU queue remains
+ * on its node. `taken` counts the records before they leave the CPU
+ * queues. A queue that another writer drains, while the node writers
+ * stop, is left to it.
+ *
+ * Every queue is swapped while the locks of all of them are held, empty
+ * ones included: a push is then either before the pass on every queue
+ * or after it, and a thread that moved from a queue not swapped yet to
+ * one already swapped cannot get its later record written first.
+ */
+struct cpu_drain
+{
+    std::vector<std::tuple<std::uint64_t, std::size_t>> heap;
+    std::vector<std::size_t> locked;
+
+    void take(const std::vector<std::size_t> &cpus, record_queue &to,
+              std::atomic<std::size_t> *taken = nullptr)
+    {
+        heap.clear();
+        locked.clear();
+        for (auto cpu : cpus)
+        {
+            auto &q = *logger::cpu_queues[cpu];
+            if (q.draining.test_and_set(std::memory_order_acquire))
+                continue;
+            lock_cpu_queue(q);
+            locked.push_back(cpu);
+        }
+        for (auto cpu : locked)
+        {
+            auto &q = *logger::cpu_queues[cpu];
+            std::swap(q.records, q.spare);
+            if (taken)
+                *taken += q.spare.size();
+            q.size.store(0, std::memory_order_relaxed);
+        }
+        for (auto cpu : locked)
+        {
+            auto &q = *logger::cpu_queues[cpu];
+            q.lock.clear(std::memory_order_release);
+            if (q.spare.empty())
+                q.draining.clear(std::memory_order_release);
+            else
+                heap.emplace_back(q.spare.front().enqueue_ns, cpu);
+        }
+        std::ranges::make_heap(heap, std::greater<>());
+        while (!heap.empty())
+        {
+            std::ranges::pop_heap(heap, std::greater<>());
+            auto &q = *logger::cpu_queues[std::get<1>(heap.back())];
+            auto &from = q.spare;
+            if (from.front().seq == 0)
+                from.front().seq = ++logger::sequence;
+            move_record(from, to, true);
+            if (from.empty())
+            {
+                q.draining.clear(std::memory_order_release);
+                heap.pop_back();
+                continue;
+            }
+            std::get<0>(heap.back()) = from.front().enqueue_ns;
+            std::ranges::push_heap(heap, std::greater<>());
+        }
+    }
+};
+
+/*
+ * The drain of the main writer and its CPUs, all of them. At namespace
+ * scope rather than local to drain_cpu_queues(): stop_at_exit() drains
+ * them, and a function-local static first built after init_writer()
+ * registered it would be destroyed before it runs.
+ */
+cpu_drain main_drain;
+std::vector<std::size_t> main_cpus = []
+{
+    std::vector<std::size_t> all(logger::cpu_count);
+    std::iota(all.begin(), all.end(), 0);
+    return all;
+}();
+
+// The CPU queues of the main writer, log_mutex must be held
+void drain_cpu_queues()
+{
+    main_drain.take(main_cpus, logger::log_queue);
+}
+
+/*
+ * Wakes the writer of a node if it waits, see writer_sleeping: the
+ * caller fences between its push and this call.
+ */
+void wake_node_writer(int node)
+{
+    auto &w = *node_writers[static_cast<std::size_t>(node)];
+    if (!w.sleeping.load())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+    }
+    w.cv.notify_one();
+}
+
+inline std::size_t node_pending(const node_writer &w)
+{
+    std::size_t size = 0;
+    for (auto cpu : w.cpus)
+        size += logger::cpu_queues[cpu]->size.load();
+    return size;
+}
+
+/*
+ * The writer of one node: it runs on the CPUs of the node and writes
+ * the records of their queues to the node file. Once stopped, it
+ * drains them before it returns.
+ */
+void write_node(std::stop_token stop, node_writer &w)
+{
+    run_on_node(w.node);
+    cpu_drain drain;
+    record_queue batch;
+    file_target target = {w.file, w.index, w.search};
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(w.mutex);
+            w.cv.wait(lock,
+                      [&]
+                      {
+                          w.sleeping.store(true);
+                          std::atomic_thread_fence(std::memory_order_seq_cst);
+                          return node_pending(w) > 0
+                                 || stop.stop_requested();
+                      });
+            w.sleeping.store(false, std::memory_order_relaxed);
+        }
+        keep_warm(batch);
+        drain.take(w.cpus, batch, &w.in_flight);
+        while (!batch.empty())
+        {
+            auto &elem = batch.front();
+            OAK_PROBE(dequeue, elem.lvl, elem.message.size(), elem.seq);
+            if (elem.dest == destination::all
+                || elem.dest == destination::file)
+                write_sink(destination::file, elem.message, elem.lvl,
+                           elem.seq, false, &target);
+            else
+            {
+                std::lock_guard<std::mutex> sinks(logger::sink_mutex);
+                write_sink(elem.dest, elem.message, elem.lvl, elem.seq);
+            }
+            batch.pop_front();
+        }
+        w.file << std::flush;
+        w.in_flight = 0;
+        if (stop.stop_requested() && node_pending(w) == 0)
+            break;
+    }
+    close_file_index(w.index);
+    close_search_index(w.search);
+    int fd = open(w.path.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Starts a writer per node if set_node_writers() asked for it, on the
+ * current log file. set_file() restarts them on the new one.
+ */
+void start_node_writers()
+{
+    std::scoped_lock lock(logger::sink_mutex, logger::log_mutex);
+    if (!logger::node_writers || !logger::log_file.is_open()
+        || logger::log_file_path.empty())
+        return;
+    if (node_writers.empty())
+    {
+        for (int node = 0; node < numa_nodes(); ++node)
+        {
+            node_writers.push_back(std::make_unique<node_writer>());
+            node_writers.back()->node = node;
+        }
+        for (std::size_t cpu = 0; cpu < logger::cpu_count; ++cpu)
+            node_writers[static_cast<std::size_t>(
+                             logger::cpu_queues[cpu]->node)]
+                ->cpus.push_back(cpu);
+    }
+    for (auto &w : node_writers)
+    {
+        w->path = std::format("{}.node{}", logger::log_file_path, w->node);
+        w->file.open(w->path, std::ios::app);
+        open_file_index(w->index, w->path);
+        open_search_index(w->search, w->path);
+        w->thread.emplace([target = w.get()](std::stop_token stop)
+                          { write_node(stop, *target); });
+    }
+    node_writers_running = true;
+}
+
+// Stops the writers of the nodes once they have drained their queues
+void stop_node_writers()
+{
+    if (!node_writers_running.exchange(false))
+        return;
+    for (auto &w : node_writers)
+    {
+        w->thread->request_stop();
+        {
+            std::lock_guard<std::mutex> lock(w->mutex);
+        }
+        w->cv.notify_one();
+        w->thread.reset();
+        w->file.close();
+    }
+}
+
+// Empties the CPU queues, log_mutex must be held
+std::size_t clear_cpu_queues()
+{
+    std::size_t size = 0;
+    for (auto *queue : logger::cpu_queues)
+    {
+        auto &q = *queue;
+        lock_cpu_queue(q);
+        size += q.records.size();
+        q.records.clear();
+        q.size.store(0, std::memory_order_relaxed);
+        q.lock.clear(std::memory_order_release);
+    }
+    return size;
+}
+
+} // namespace
+
+namespace
+{
+
+std::expected<int, std::string> open_log_file(const std::string &file)
+{
+    std::scoped_lock lock(logger::sink_mutex, logger::log_mutex);
+    if (logger::log_file.is_open())
+    {
+        OAK_PROBE(rotate, level::output, 0, logger::sequence.load());
+        logger::log_file.close();
+    }
+    close_file_index(file_index);
+    close_search_index(search_index);
+    if (logger::log_file_format.load() == file_format::framed
+        && std::filesystem::exists(file))
+    {
+        auto recovered = recover_framed_file(file);
+        if (!recovered.has_value())
+            return std::unexpected(recovered.error());
+    }
+    logger::log_file.open(file, std::ios::app);
+    logger::log_file_path = file;
+    if (!logger::log_file.is_open())
+    {
+        return std::unexpected("Could not open log file");
+    }
+    open_file_index(file_index, file);
+    open_search_index(search_index, file);
+    if (!logger::log_file.good())
+    {
+        return std::unexpected("Error opening log file");
+    }
+    return 0;
+}
+
+} // namespace
+
+[[nodiscard]] std::expected<int, std::string> oak::set_file(const std::string &file)
+{
+    // The node writers finish the old file, then move to the new one
+    bool nodes = node_writers_running.load();
+    if (nodes)
+        stop_node_writers();
+    auto r = open_log_file(file);
+    if (nodes)
+        start_node_writers();
+    return r;
+}
+
+void oak::close_file()
+{
+    std::scoped_lock lock(logger::sink_mutex, logger::log_mutex);
+    if (logger::log_file.is_open())
+        logger::log_file.close();
+    close_file_index(file_index);
+    close_search_index(search_index);
+}
+
+namespace
+{
+
+/*
+ * Bytes from `from` up to the start of the next record, among the
+ * `count` bytes of the ring from there, all of them if none starts.
+ */
+std::uint64_t ring_skip_record(const char *data, std::uint64_t capacity,
+                               std::uint64_t from, std::uint64_t count)
+{
+    if (data[(from + capacity - 1) % capacity] == '\n')
+        return 0;
+    auto first = std::min(count, capacity - from);
+    auto *nl = static_cast<const char *>(std::memchr(data + from, '\n', first));
+    if (nl)
+        return static_cast<std::uint64_t>(nl - (data + from)) + 1;
+    nl = static_cast<const char *>(std::memchr(data, '\n', count - first));
+    if (nl)
+        return first + static_cast<std::uint64_t>(nl - data) + 1;
+    return count;
+}
+
+// Copies `size` bytes into the ring at `at`, wrapping around
+void ring_copy(char *data, std::uint64_t capacity, std::uint64_t at,
+               const char *bytes, std::uint64_t size)
+{
+    auto first = std::min(size, capacity - at);
+    std::memcpy(data + at, bytes, first);
+    std::memcpy(data, bytes + first, size - first);
+}
+
+std::optional<ring_header> read_ring_header(int fd)
+{
+    ring_header header;
+    if (pread(fd, &header, sizeof(header), 0)
+            != static_cast<ssize_t>(sizeof(header))
+        || header.magic != ring_header::magic_value)
+        return std::nullopt;
+    return header;
+}
+
+} // namespace
+
+oak::ring_file::~ring_file()
+{
+    if (map)
+        munmap(map, map_size);
+    if (fd >= 0)
+        close(fd);
+}
+
+ssize_t oak::ring_file::write(const char *record, std::size_t size)
+{
+    auto &h = *header;
+    auto n = std::min<std::uint64_t>(size, h.data_size);
+    // The head is moved before the bytes it held are overwritten
+    if (h.used + n > h.data_size)
+    {
+        auto dropped = h.used + n - h.data_size;
+        auto kept = h.used - dropped;
+        auto head = (h.head + dropped) % h.data_size;
+        auto skip =
+            kept == 0 ? 0 : ring_skip_record(data, h.data_size, head, kept);
+        h.head = (head + skip) % h.data_size;
+        h.used = kept - skip;
+    }
+    ring_copy(data, h.data_size, h.tail, record + (size - n), n);
+    h.tail += n;
+    if (h.tail >= h.data_size)
+    {
+        h.tail -= h.data_size;
+        h.generation++;
+    }
+    h.used += n;
+    return static_cast<ssize_t>(size);
+}
+
+int oak::ring_file::flush()
+{
+    return msync(map, map_size, MS_SYNC);
+}
+
+std::expected<std::shared_ptr<oak::ring_file>, std::string>
+oak::open_ring_file(const std::string &path, std::size_t size)
+{
+    auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    size = std::max((size + page - 1) / page * page, 2 * page);
+
+    std::shared_ptr<ring_file> ring(new ring_file());
+    ring->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ring->fd < 0)
+        return std::unexpected("Could not open ring file");
+    struct stat st;
+    if (fstat(ring->fd, &st) < 0)
+        return std::unexpected("Could not open ring file");
+
+    auto existing = read_ring_header(ring->fd);
+    if (st.st_size > 0 && !existing.has_value())
+        return std::unexpected("Not a ring file");
+    bool keep = existing.has_value()
+                && static_cast<std::size_t>(st.st_size) == size
+                && existing->data_offset == page
+                && existing->data_size == size - page;
+    if (!keep && ftruncate(ring->fd, 0) < 0)
+        return std::unexpected("Could not truncate ring file");
+    if (posix_fallocate(ring->fd, 0, static_cast<off_t>(size)) != 0)
+        return std::unexpected("Could not allocate ring file");
+
+    ring->map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ring->fd, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = nullptr;
+        return std::unexpected("Could not map ring file");
+    }
+    ring->map_size = size;
+    ring->header = static_cast<ring_header *>(ring->map);
+    ring->data = static_cast<char *>(ring->map) + page;
+    if (!keep)
+    {
+        *ring->header = ring_header{};
+        ring->header->data_offset = page;
+        ring->header->data_size = size - page;
+        ring->header->magic = ring_header::magic_value;
+    }
+    return ring;
+}
+
+bool oak::is_ring_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ring = read_ring_header(fd).has_value();
+    close(fd);
+    return ring;
+}
+
+std::expected<std::string, std::string>
+oak::read_ring_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return std::unexpected("Could not open ring file");
+    struct stat st;
+    auto header = read_ring_header(fd);
+    if (!header.has_value() || fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return std::unexpected("Not a ring file");
+    }
+    auto &h = header.value();
+    if (h.data_offset + h.data_size > static_cast<std::uint64_t>(st.st_size)
+        || h.head >= h.data_size || h.used > h.data_size)
+    {
+        close(fd);
+        return std::unexpected("Corrupted ring file");
+    }
+
+    // The records from the head, in at most two reads
+    std::string records(h.used, '\0');
+    auto first = std::min(h.used, h.data_size - h.head);
+    bool ok = pread(fd, records.data(), first,
+                    static_cast<off_t>(h.data_offset + h.head))
+                  == static_cast<ssize_t>(first)
+              && pread(fd, records.data() + first, h.used - first,
+                       static_cast<off_t>(h.data_offset))
+                     == static_cast<ssize_t>(h.used - first);
+    close(fd);
+    if (!ok)
+        return std::unexpected("Could not read ring file");
+    return records;
+}
+
+namespace
+{
+
+constexpr auto crc32c_table = []
+{
+    std::array<std::uint32_t, 256> table = {};
+    for (std::uint32_t i = 0; i < 256; ++i)
+    {
+        auto crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1u)));
+        table[i] = crc;
+    }
+    return table;
+}();
+
+std::uint32_t crc32c_bytes(std::uint32_t crc, const unsigned char *p,
+                           std::size_t size)
+{
+    for (; size > 0; --size, ++p)
+        crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef OAK_HAVE_CRC32_SSE42
+// Eight bytes per crc32 instruction, chosen at run time
+__attribute__((target("sse4.2"))) std::uint32_t
+crc32c_sse42(std::uint32_t crc, const unsigned char *p, std::size_t size)
+{
+    std::uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    for (; size > 0; --size, ++p)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+// A file mapped read only, empty if it could not be
+struct mapped_file
+{
+    const char *data = nullptr;
+    std::uint64_t size = 0;
+    bool ok = false;
+
+    explicit mapped_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            size = static_cast<std::uint64_t>(st.st_size);
+            void *map = size > 0 ? mmap(nullptr, size, PROT_READ,
+                                        MAP_PRIVATE, fd, 0)
+                                 : nullptr;
+            ok = map != MAP_FAILED;
+            if (ok)
+                data = static_cast<const char *>(map);
+        }
+        close(fd);
+    }
+
+    ~mapped_file()
+    {
+        if (data)
+            munmap(const_cast<char *>(data), size);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+};
+
+bool has_frame_magic(const char *data, std::uint64_t size)
+{
+    std::uint32_t magic = 0;
+    if (size >= sizeof(magic))
+        std::memcpy(&magic, data, sizeof(magic));
+    return magic == frame_header::magic_value;
+}
+
+// The size of the valid frame at `at`, 0 if there is none
+std::uint64_t valid_frame(const char *data, std::uint64_t size,
+                          std::uint64_t at)
+{
+    frame_header frame;
+    if (size - at < sizeof(frame))
+        return 0;
+    std::memcpy(&frame, data + at, sizeof(frame));
+    if (frame.magic != frame_header::magic_value
+        || frame.size > size - at - sizeof(frame))
+        return 0;
+    auto crc = oak::crc32c(data + at + sizeof(frame), frame.size,
+                           oak::crc32c(&frame.size, sizeof(frame.size)));
+    return crc == frame.crc ? sizeof(frame) + frame.size : 0;
+}
+
+// The byte of the magic that text never holds, 0xf5 is not UTF-8
+constexpr char frame_mark = static_cast<char>(0xf5);
+constexpr std::uint64_t frame_mark_at = 3;
+
+/*
+ * Calls f with the record of every valid frame from `at` to `end`,
+ * skipping a corrupted one up to the next valid frame. Returns the
+ * bytes skipped.
+ */
+template <typename F>
+std::uint64_t for_each_frame(const char *data, std::uint64_t size,
+                             std::uint64_t at, std::uint64_t stop, F &&f)
+{
+    std::uint64_t corrupted = 0;
+    while (at < stop)
+    {
+        if (auto frame = valid_frame(data, size, at))
+        {
+            f(std::string_view(data + at + sizeof(frame_header),
+                               frame - sizeof(frame_header)));
+            at += frame;
+            continue;
+        }
+        auto next = stop;
+        for (auto from = at + frame_mark_at + 1; from < stop;)
+        {
+            auto *mark = static_cast<const char *>(
+                std::memchr(data + from, frame_mark, stop - from));
+            if (!mark)
+                break;
+            auto candidate =
+                static_cast<std::uint64_t>(mark - data) - frame_mark_at;
+            if (valid_frame(data, size, candidate))
+            {
+                next = candidate;
+                break;
+            }
+            from = candidate + frame_mark_at + 1;
+        }
+        corrupted += next - at;
+        at = next;
+    }
+    return corrupted;
+}
+
+} // namespace
+
+std::uint32_t oak::crc32c(const void *data, std::size_t size,
+                          std::uint32_t crc)
+{
+    auto *p = static_cast<const unsigned char *>(data);
+#ifdef OAK_HAVE_CRC32_SSE42
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return ~crc32c_sse42(~crc, p, size);
+#endif
+    return ~crc32c_bytes(~crc, p, size);
+}
+
+std::expected<oak::recovery_report, std::string>
+oak::recover_framed_file(const std::string &path)
+{
+    recovery_report report;
+    {
+        mapped_file file(path);
+        if (!file.ok)
+            return std::unexpected("Could not open framed file");
+        if (file.size > 0 && file.data[0] != '\0'
+            && !has_frame_magic(file.data, file.size))
+            return std::unexpected("Not a framed file");
+
+        // Back from the end, to the first mark that starts a valid frame
+        auto end = file.size;
+        while (end > frame_mark_at)
+        {
+            auto *mark = static_cast<const char *>(
+                memrchr(file.data + frame_mark_at, frame_mark,
+                        end - frame_mark_at));
+            if (!mark)
+                break;
+            auto at = static_cast<std::uint64_t>(mark - file.data)
+                      - frame_mark_at;
+            if (auto size = valid_frame(file.data, file.size, at))
+            {
+                report.size = at + size;
+                break;
+            }
+            end = at + frame_mark_at;
+        }
+        report.truncated = file.size - report.size;
+    }
+    if (report.truncated > 0
+        && truncate(path.c_str(), static_cast<off_t>(report.size)) < 0)
+        return std::unexpected("Could not truncate framed file");
+    return report;
+}
+
+bool oak::is_framed_file(const std::string &path)
+{
+    mapped_file file(path);
+    return file.ok && has_frame_magic(file.data, file.size);
+}
+
+std::expected<oak::framed_contents, std::string>
+oak::read_framed_file(const std::string &path)
+{
+    mapped_file file(path);
+    if (!file.ok)
+        return std::unexpected("Could not open framed file");
+    if (file.size > 0 && !has_frame_magic(file.data, file.size))
+        return std::unexpected("Not a framed file");
+
+    framed_contents contents;
+    contents.corrupted = for_each_frame(
+        file.data, file.size, 0, file.size,
+        [&contents](std::string_view record)
+        {
+            contents.records.append(record);
+            contents.count++;
+        });
+    return contents;
+}
+
+std::expected<std::vector<oak::index_entry>, std::string>
+oak::read_file_index(const std::string &path)
+{
+    std::ifstream file(path + ".idx", std::ios::binary);
+    if (!file.is_open())
+        return std::unexpected("Could not open index file");
+    std::vector<index_entry> entries;
+    index_entry entry;
+    while (file.read(reinterpret_cast<char *>(&entry), sizeof(entry)))
+        entries.push_back(entry);
+    return entries;
+}
+
+std::expected<std::uint64_t, std::string>
+oak::read_time_range(const std::string &path,
+                     std::chrono::system_clock::time_point from,
+                     std::chrono::system_clock::time_point to,
+                     const std::function<void(std::string_view)> &f)
+{
+    auto entries = read_file_index(path);
+    if (!entries.has_value())
+        return std::unexpected(entries.error());
+    mapped_file file(path);
+    if (!file.ok)
+        return std::unexpected("Could not open log file");
+
+    auto ns = [](std::chrono::system_clock::time_point t)
+    {
+        return static_cast<std::uint64_t>(std::max<std::int64_t>(
+            0, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   t.time_since_epoch())
+                   .count()));
+    };
+    auto from_ns = ns(from);
+    auto to_ns = ns(to);
+    // From the last entry written before `from`, to the first after `to`
+    auto first = std::partition_point(entries->begin(), entries->end(),
+                                      [from_ns](const index_entry &e)
+                                      { return e.time_ns < from_ns; });
+    auto last = std::partition_point(first, entries->end(),
+                                     [to_ns](const index_entry &e)
+                                     { return e.time_ns <= to_ns; });
+    std::uint64_t begin = first == entries->begin() ? 0 : (first - 1)->offset;
+    std::uint64_t end = last == entries->end() ? file.size : last->offset;
+    begin = std::min(begin, file.size);
+    end = std::clamp(end, begin, file.size);
+    if (begin == end)
+        return 0;
+
+    auto page = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    auto aligned = begin / page * page;
+    madvise(const_cast<char *>(file.data + aligned), end - aligned,
+            MADV_SEQUENTIAL);
+    std::uint64_t passed = 0;
+    if (has_frame_magic(file.data, file.size))
+    {
+        for_each_frame(file.data, file.size, begin, end,
+                       [&f, &passed](std::string_view record)
+                       {
+                           f(record);
+                           passed += record.size();
+                       });
+        return passed;
+    }
+    constexpr std::uint64_t chunk = 1 << 20;
+    for (auto at = begin; at < end; at += chunk)
+    {
+        auto size = std::min(chunk, end - at);
+        f(std::string_view(file.data + at, size));
+        passed += size;
+    }
+    return passed;
+}
+
+namespace
+{
+
+// Whether `record` holds `token` as a whole token
+bool has_token(std::string_view record, std::string_view token)
+{
+    for (auto at = record.find(token); at != std::string_view::npos;
+         at = record.find(token, at + 1))
+    {
+        auto end = at + token.size();
+        if ((at == 0 || !token_char(record[at - 1]))
+            && (end == record.size() || !token_char(record[end])))
+            return true;
+    }
+    return false;
+}
+
+// Whether a filter may hold every token
+bool bloom_may_hold(const char *filter, const bloom_header &header,
+                    const std::vector<std::string_view> &tokens)
+{
+    bool may_hold = true;
+    for (auto token : tokens)
+        for_each_bloom_bit(token, header.bits, header.hashes,
+                           [filter, &may_hold](std::uint64_t bit)
+                           {
+                               std::uint64_t word;
+                               std::memcpy(&word, filter + bit / 64 * 8,
+                                           sizeof(word));
+                               may_hold = may_hold && ((word >> (bit % 64)) & 1);
+                           });
+    return may_hold;
+}
+
+} // namespace
+
+std::expected<oak::search_report, std::string>
+oak::search_file(const std::string &path, std::string_view query,
+                 const std::function<void(std::string_view)> &f)
+{
+    std::vector<std::string_view> tokens;
+    for_each_token(query,
+                   [&tokens](std::string_view token)
+                   { tokens.push_back(token); });
+    if (tokens.empty())
+        return std::unexpected("Empty query");
+    mapped_file file(path);
+    if (!file.ok)
+        return std::unexpected("Could not open log file");
+    mapped_file sidecar(path + ".bloom"); // none, the whole file is read
+    bool framed = has_frame_magic(file.data, file.size);
+
+    search_report report;
+    auto match = [&report, &tokens, &f](std::string_view record)
+    {
+        if (record.ends_with('\n'))
+            record.remove_suffix(1);
+        for (auto token : tokens)
+            if (!has_token(record, token))
+                return;
+        report.matches++;
+        f(record);
+    };
+    auto scan = [&file, framed, &match](std::uint64_t begin, std::uint64_t end)
+    {
+        if (framed)
+        {
+            for_each_frame(file.data, file.size, begin, end, match);
+            return;
+        }
+        while (begin < end)
+        {
+            auto *nl = static_cast<const char *>(
+                std::memchr(file.data + begin, '\n', end - begin));
+            auto stop = nl ? static_cast<std::uint64_t>(nl - file.data) + 1
+                           : end;
+            match(std::string_view(file.data + begin, stop - begin));
+            begin = stop;
+        }
+    };
+
+    // Every segment is read or skipped, and the gaps between them read
+    std::uint64_t cursor = 0;
+    std::uint64_t at = 0;
+    while (sidecar.ok && sidecar.size - at >= sizeof(bloom_header))
+    {
+        bloom_header header;
+        std::memcpy(&header, sidecar.data + at, sizeof(header));
+        if (header.magic != bloom_header::magic_value || header.bits < 64
+            || !std::has_single_bit(header.bits) || header.hashes > 64
+            || header.bits / 8 > sidecar.size - at - sizeof(header)
+            || header.begin < cursor || header.begin > header.end
+            || header.end > file.size)
+            break;
+        auto *filter = sidecar.data + at + sizeof(header);
+        at += sizeof(header) + header.bits / 8;
+        report.segments++;
+        scan(cursor, header.begin);
+        if (bloom_may_hold(filter, header, tokens))
+            scan(header.begin, header.end);
+        else
+            report.skipped++;
+        cursor = header.end;
+    }
+    scan(cursor, file.size);
+    return report;
+}
+
+#ifdef OAK_USE_SOCKETS
+void oak::close_socket()
+{
+    std::scoped_lock lock(logger::sink_mutex, logger::log_mutex);
+    if (logger::log_socket > 0)
+        close(logger::log_socket);
+    logger::log_socket = -1;
+}
+#endif
+
+void oak::format_prefix(std::string &out, const level &lvl,
+                        long unsigned int flags, std::uint64_t seq,
+                        std::time_t when)
+{
+    bool json = flags & static_cast<long unsigned int>(flags::json);
+    if (flags > 0 && !json)
+        out += "[ ";
+    if (json)
+        out += "{ ";
+    if (flags & static_cast<long unsigned int>(flags::level))
+    {
+        out += json ? "\"level\": \"" : "level=";
+        out += level_name(lvl);
+        out += json ? "\"" : " ";
+    }
+    if (flags
+        & (static_cast<long unsigned int>(flags::date)
+           | static_cast<long unsigned int>(flags::time)))
+    {
+        auto now_time_t =
+            when != 0 ? when
+                      : std::chrono::system_clock::to_time_t(
+                            std::chrono::system_clock::now());
+        std::tm now_tm;
+        localtime_r(&now_time_t, &now_tm);
+        char buf[16];
+        if (flags & static_cast<long unsigned int>(flags::date))
+        {
+            std::strftime(buf, sizeof(buf), "%Y-%m-%d", &now_tm);
+            out += json ? ", \"date\": \"" : "date=";
+            out += buf;
+            out += json ? "\"" : " ";
+        }
+        if (flags & static_cast<long unsigned int>(flags::time))
+        {
+            std::strftime(buf, sizeof(buf), "%H:%M:%S", &now_tm);
+            out += json ? ", \"time\": \"" : "time=";
+            out += buf;
+            out += json ? "\"" : " ";
+        }
+    }
+    if (flags & static_cast<long unsigned int>(flags::pid))
+    {
+        char buf[16];
+        auto res = std::to_chars(buf, buf + sizeof(buf), getpid());
+        out += json ? ", \"pid\": " : "pid=";
+        out.append(buf, res.ptr);
+        if (!json)
+            out += " ";
+    }
+    if (flags & static_cast<long unsigned int>(flags::tid))
+    {
+        out += json ? ", \"tid\": " : "tid=";
+        out += thread_id_string();
+        if (!json)
+            out += " ";
+    }
+    if (flags & static_cast<long unsigned int>(flags::seq))
+    {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof(buf), seq);
+        out += json ? ", \"seq\": " : "seq=";
+        out.append(buf, res.ptr);
+        if (!json)
+            out += " ";
+    }
+
+    if (flags > 0 && !json)
+        out += "] ";
+    if (flags != static_cast<long unsigned int>(flags::json) && json)
+        out += ", ";
+}
+
+namespace
+{
+
+constexpr auto digit_pairs = []
+{
+    std::array<char, 200> pairs = {};
+    for (std::size_t i = 0; i < 100; ++i)
+    {
+        pairs[i * 2] = static_cast<char>('0' + i / 10);
+        pairs[i * 2 + 1] = static_cast<char>('0' + i % 10);
+    }
+    return pairs;
+}();
+
+// Writes the digits of v backwards from end, two at a time
+char *write_digits(char *end, std::uint64_t v)
+{
+    while (v >= 100)
+    {
+        end -= 2;
+        std::memcpy(end, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        end -= 2;
+        std::memcpy(end, &digit_pairs[v * 2], 2);
+    }
+    else
+        *--end = static_cast<char>('0' + v);
+    return end;
+}
+
+// Appends an argument as "{}" would, false for a user defined type
+struct fast_arg
+{
+    std::string &out;
+
+    template <typename T> bool operator()(T value) const
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            out += value ? "true" : "false";
+        else if constexpr (std::is_same_v<T, char>)
+            out += value;
+        else if constexpr (std::is_integral_v<T> && sizeof(T) <= 8)
+        {
+            char buf[24];
+            auto end = buf + sizeof(buf);
+            auto magnitude = static_cast<std::uint64_t>(value);
+            if constexpr (std::is_signed_v<T>)
+                if (value < 0)
+                    magnitude = 0 - magnitude;
+            auto begin = write_digits(end, magnitude);
+            if constexpr (std::is_signed_v<T>)
+                if (value < 0)
+                    *--begin = '-';
+            out.append(begin, end);
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+        {
+            char buf[128];
+            auto res = std::to_chars(buf, buf + sizeof(buf), value);
+            if (res.ec != std::errc())
+                return false;
+            out.append(buf, res.ptr);
+        }
+        else if constexpr (std::is_same_v<T, const char *>)
+        {
+            if (value == nullptr)
+                return false;
+            out += value;
+        }
+        else if constexpr (std::is_same_v<T, std::string_view>)
+            out += value;
+        else if constexpr (std::is_same_v<T, const void *>)
+        {
+            char buf[24];
+            auto res = std::to_chars(buf, buf + sizeof(buf),
+                                     reinterpret_cast<std::uintptr_t>(value),
+                                     16);
+            out += "0x";
+            out.append(buf, res.ptr);
+        }
+        else
+            return false;
+        return true;
+    }
+};
+
+/*
+ * Formats the common case in place: bare {} placeholders and builtin
+ * arguments. Anything else, a format spec, an argument index, a user
+ * defined formatter or an error, leaves out as it was and returns false
+ * for std::vformat_to.
+ */
+bool fast_format(std::string &out, std::string_view fmt,
+                 std::format_args args)
+{
+    auto start = out.size();
+    std::size_t next = 0;
+    std::size_t pos = 0;
+    while (pos < fmt.size())
+    {
+        auto brace = fmt.find_first_of("{}", pos);
+        out += fmt.substr(pos, brace - pos);
+        if (brace == std::string_view::npos)
+            break;
+        if (brace + 1 < fmt.size() && fmt[brace + 1] == fmt[brace])
+            out += fmt[brace];
+        else if (fmt[brace] == '}' || brace + 1 == fmt.size()
+                 || fmt[brace + 1] != '}'
+                 || !std::visit_format_arg(fast_arg{out}, args.get(next++)))
+        {
+            out.resize(start);
+            return false;
+        }
+        pos = brace + 2;
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+// The hex digit of each nibble, '0' + n or 'a' - 10 + n
+__m128i hex_digits(__m128i nibbles)
+{
+    auto letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)),
+                                 _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+#endif
+
+} // namespace
+
+char *oak::hex_encode(const std::byte *data, std::size_t size, char *out)
+{
+    std::size_t i = 0;
+#ifdef __SSE2__
+    // 16 bytes at a time, the high and low nibbles interleaved
+    auto mask = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= size; i += 16)
+    {
+        auto bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto high = hex_digits(_mm_and_si128(_mm_srli_epi16(bytes, 4), mask));
+        auto low = hex_digits(_mm_and_si128(bytes, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                         _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16),
+                         _mm_unpackhi_epi8(high, low));
+        out += 32;
+    }
+#endif
+    static constexpr char digits[] = "0123456789abcdef";
+    for (; i < size; ++i)
+    {
+        auto byte = std::to_integer<unsigned>(data[i]);
+        *out++ = digits[byte >> 4];
+        *out++ = digits[byte & 0x0f];
+    }
+    return out;
+}
+
+void oak::vformat_append(std::string &out, std::string_view fmt,
+                         std::format_args args)
+{
+    if (!fast_format(out, fmt, args))
+        std::vformat_to(std::back_inserter(out), fmt, args);
+}
+
+void oak::vformat_record(std::string &out, const level &lvl,
+                         std::string_view fmt, std::format_args args,
+                         std::uint64_t seq)
+{
+    auto flags = get_flags();
+    bool json = flags & static_cast<long unsigned int>(flags::json);
+    out.clear();
+    format_prefix(out, lvl, flags, seq);
+    if (json)
+        out += "\"message\": \"";
+    try
+    {
+        vformat_append(out, fmt, args);
+    }
+    catch (const std::exception &e)
+    {
+        out.clear();
+        return;
+    }
+    out += json ? "\" }\n" : "\n";
+}
+
+namespace
+{
+
+// Hands a formatted record to the sinks or the queue, by write mode
+void submit(std::string_view message, const destination &d, const level &lvl,
+            bool color, std::uint64_t seq)
+{
+    auto mode = logger::mode.load(std::memory_order_relaxed);
+    bool running = logger::writer_running.load(std::memory_order_relaxed);
+    if (mode == write_mode::direct
+        || (mode != write_mode::queued && !running))
+        write_direct(message, d, lvl, color, seq);
+    else if (mode != write_mode::hybrid
+             || !try_write_direct(message, d, lvl, color, seq))
+        add_to_queue(message, d, lvl, color, seq);
+}
+
+} // namespace
+
+void oak::dump_backlog()
+{
+    auto flags = get_flags();
+    bool json = flags & static_cast<long unsigned int>(flags::json);
+    bool color = flags & static_cast<long unsigned int>(flags::color);
+    auto &message = thread_buffer();
+    thread_backlog().drain(
+        [&](const backlog_entry &entry)
+        {
+            std::uint64_t seq = 0;
+            if (flags & static_cast<long unsigned int>(flags::seq))
+                seq = ++logger::sequence;
+            message.clear();
+            format_prefix(message, entry.lvl, flags, seq, entry.when);
+            if (json)
+                message += "\"message\": \"";
+            try
+            {
+                if (entry.format)
+                    entry.format(message, entry.fmt, entry.storage);
+                else
+                    message += entry.text;
+            }
+            catch (const std::exception &e)
+            {
+                return;
+            }
+            message += json ? "\" }\n" : "\n";
+            submit(message, destination::all, entry.lvl, color, seq);
+        });
+}
+
+void oak::log_slow(const level &lvl, std::string_view fmt,
+                   std::format_args args, const backlog_args &backlog)
+{
+    if (get_level() > lvl)
+        backlog.capture(lvl, fmt, backlog.args);
+    else
+        vlog(lvl, fmt, args);
+}
+
+void oak::vlog(const level &lvl, std::string_view fmt, std::format_args args,
+               const destination &d)
+{
+    // Sampled out under overload, before any formatting
+    auto one_in = logger::sample_one_in.load(std::memory_order_relaxed);
+    if (one_in > 0 && lvl < level::warn && !sample_keep(one_in))
+        return;
+
+    // The context of an error is written before it
+    if (lvl == level::error
+        && logger::backlog_level.load(std::memory_order_relaxed)
+               != level::disabled)
+        dump_backlog();
+
+    auto flags = get_flags();
+    // Printed in the record, so it is taken before formatting; otherwise
+    // it is taken when the record is queued, in queue order
+    std::uint64_t seq = 0;
+    if (flags & static_cast<long unsigned int>(flags::seq))
+        seq = ++logger::sequence;
+    auto &message = thread_buffer();
+    vformat_record(message, lvl, fmt, args, seq);
+    if (message.empty())
+        return;
+    // One record for every destination, the writer fans it out
+    bool color = d == destination::all
+                 && flags & static_cast<long unsigned int>(flags::color);
+    submit(message, d, lvl, color, seq);
+}
+
+void oak::add_to_queue(std::string_view str, const destination &d,
+                       const level &lvl, bool color, std::uint64_t seq)
+{
+#ifdef OAK_USE_STATS
+    auto start = now_ns();
+#else
+    std::uint64_t start = 0;
+#endif
+    // stop_writer() is draining: reject without waiting for the lock
+    if (closing.load(std::memory_order_relaxed)) [[unlikely]]
+    {
+        OAK_PROBE(drop, lvl, str.size(), 0);
+        rejected.fetch_add(1, std::memory_order_relaxed);
+#ifdef OAK_USE_STATS
+        local_stats.drops.add(1);
+#endif
+        return;
+    }
+    bool dropped = false;
+    bool wake = true;
+    if (logger::order.load(std::memory_order_relaxed) == ordering::per_cpu)
+    {
+        auto *q = push_cpu(str, d, lvl, color, seq);
+        dropped = q == nullptr;
+#ifdef OAK_USE_STATS
+        if (dropped)
+            local_stats.drops.add(1);
+#endif
+        // The push before the sleeping flags are read, see writer_sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!dropped && node_writers_running.load())
+        {
+            wake_node_writer(q->node);
+            wake = false;
+        }
+        else
+            wake = !dropped && writer_sleeping.load();
+        if (wake)
+        {
+            // Once taken, the writer is in its wait and gets the notify
+            std::lock_guard<std::mutex> lock(logger::log_mutex);
+        }
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        // Dropped records consume a sequence number too, so that the
+        // gaps show up offline
+        if (seq == 0)
+            seq = ++logger::sequence;
+        auto o = logger::order.load(std::memory_order_relaxed);
+        bool urgent = o == ordering::priority
+                      && (lvl == level::warn || lvl == level::error);
+        auto *producer = o == ordering::fair ? &thread_producer() : nullptr;
+        // A thread over its quota or capacity only loses its own records
+        std::size_t depth = producer ? producer->records.size() : queued();
+        if ((producer && !charge_quota(*producer, str.size()))
+            || (!urgent && logger::queue_capacity > 0
+                && depth >= logger::queue_capacity))
+        {
+            update_overload(queued());
+            OAK_PROBE(drop, lvl, str.size(), seq);
+#ifdef OAK_USE_STATS
+            local_stats.drops.add(1);
+#endif
+            dropped = true;
+            // The writer reports the throttled threads
+            wake = throttle_pending;
+        }
+        else
+        {
+            OAK_PROBE(enqueue, lvl, str.size(), seq);
+            auto &slot = urgent     ? logger::urgent_queue.push()
+                         : producer ? producer->records.push()
+                                    : logger::log_queue.push();
+            slot.message.assign(str);
+            slot.dest = d;
+            slot.lvl = lvl;
+            slot.color = color;
+            slot.enqueue_ns = start;
+            slot.seq = seq;
+            if (producer)
+                logger::producers_size++;
+            logger::queue_high_water =
+                std::max(logger::queue_high_water, queued());
+            if (urgent)
+                urgent_pending.store(true, std::memory_order_relaxed);
+            update_overload(queued());
+        }
+    }
+    if (wake)
+        logger::log_cv.notify_one();
+    if (dropped)
+        return;
+#ifdef OAK_USE_STATS
+    auto i = static_cast<std::size_t>(lvl);
+    local_stats.messages[i].add(1);
+    local_stats.bytes[i].add(str.size());
+    local_stats.enqueue_wait.add(now_ns() - start);
+#endif
+}
+
+std::size_t oak::queue_size()
+{
+    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    return pending();
+}
+
+oak::stats_snapshot oak::stats()
+{
+    stats_snapshot snap;
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        snap.queue_depth = pending();
+        snap.queue_high_water = logger::queue_high_water;
+    }
+#ifdef OAK_USE_STATS
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    for (std::size_t i = 0; i < num_levels; ++i)
+    {
+        snap.messages[i] = exited_threads.messages[i];
+        snap.bytes[i] = exited_threads.bytes[i];
+    }
+    snap.drops = exited_threads.drops;
+    snap.direct_writes = exited_threads.direct_writes;
+    snap.enqueue_wait = exited_threads.enqueue_wait;
+    for (auto *t : live_threads)
+        t->read(snap);
+
+    writer_side.writer_lag.read(snap.writer_lag);
+    for (std::size_t i = 0; i < num_sinks; ++i)
+    {
+        snap.sinks[i].writes = writer_side.writes[i].get();
+        snap.sinks[i].bytes = writer_side.bytes[i].get();
+        snap.sinks[i].errors = writer_side.errors[i].get();
+        writer_side.latency[i].read(snap.sinks[i].latency);
+    }
+#endif
+    return snap;
+}
+
+void oak::reset_stats()
+{
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        logger::queue_high_water = pending();
+    }
+#ifdef OAK_USE_STATS
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    exited_threads = stats_snapshot();
+    for (auto *t : live_threads)
+        t->reset();
+    writer_side.writer_lag.reset();
+    for (std::size_t i = 0; i < num_sinks; ++i)
+    {
+        writer_side.writes[i].reset();
+        writer_side.bytes[i].reset();
+        writer_side.errors[i].reset();
+        writer_side.latency[i].reset();
+    }
+#endif
+}
+
+namespace
+{
+
+/*
+ * Writes the front record of a batch, false if the shutdown deadline
+ * has passed or the writer was abandoned: the batch is then discarded.
+ */
+bool write_front(record_queue &batch)
+{
+    if (writer_abandoned())
+    {
+        batch.clear();
+        return false;
+    }
+    bool stopping = logger::close_writer.load();
+    if (stopping && past_shutdown_deadline())
+    {
+        last_shutdown.discarded += batch.size();
+        last_shutdown.deadline_expired = true;
+        batch.clear();
+        return false;
+    }
+    // Written in place, the slot keeps its memory
+    auto &elem = batch.front();
+    OAK_PROBE(dequeue, elem.lvl, elem.message.size(), elem.seq);
+    if (elem.dest == oak::destination::all)
+        write_all(elem.message, elem.lvl, elem.color, elem.seq);
+    else
+        write_sink(elem.dest, elem.message, elem.lvl, elem.seq);
+#ifdef OAK_USE_STATS
+    writer_side.writer_lag.add(now_ns() - elem.enqueue_ns);
 #endif
+    if (stopping)
+        last_shutdown.drained++;
+    batch.pop_front();
+    // Only the writer stores it, so no read-modify-write is needed
+    if (!writer_abandoned())
+        logger::in_flight.store(
+            logger::in_flight.load(std::memory_order_relaxed) - 1,
+            std::memory_order_relaxed);
+    return true;
+}
 
-[[nodiscard]] std::expected<int, std::string> oak::set_file(const std::string &file)
+// Takes the urgent lane and writes it, sink_mutex must be held
+void write_urgent(record_queue &urgent)
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
-    if (logger::log_file.is_open())
+    if (writer_abandoned())
+        return;
     {
-        logger::log_file.close();
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        keep_warm(urgent);
+        std::swap(urgent, logger::urgent_queue);
+        logger::in_flight += urgent.size();
+        urgent_pending.store(false, std::memory_order_relaxed);
     }
-    logger::log_file.open(file, std::ios::app);
-    if (!logger::log_file.is_open())
+    if (urgent.empty())
+        return;
+    while (!urgent.empty() && write_front(urgent))
     {
-        return std::unexpected("Could not open log file");
     }
-    if (!logger::log_file.good())
+    bool flush;
     {
-        return std::unexpected("Error opening log file");
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        flush = logger::urgent_flush;
+    }
+    if (flush)
+    {
+        std::cout << std::flush;
+        if (logger::log_file.is_open())
+            logger::log_file << std::flush;
     }
-    return 0;
 }
 
-void oak::close_file()
+} // namespace
+
+/*
+ * The writer takes the whole queue at once and writes it without
+ * holding log_mutex: a slow or stalled sink delays the writer only, the
+ * producers keep enqueueing into the other ring. The urgent lane is
+ * written first, and checked again between the records of the backlog.
+ * Once stopped, the writer drains the queue until it is empty or the
+ * shutdown deadline has passed. A writer still blocked in a sink well
+ * after the deadline is abandoned by stop_writer(), and returns without
+ * writing anything more once the sink does.
+ */
+void oak::writer()
+{
+    int node;
+    std::chrono::milliseconds interval;
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        node = logger::writer_node;
+        interval = logger::stats_interval;
+    }
+    run_on_node(node);
+    stats_exporter exporter;
+    exporter.run(interval);
+    record_queue batch;
+    record_queue urgent;
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(logger::log_mutex);
+        // An idle writer still wakes to export, and to a new interval
+        auto ready = [&interval]
+        {
+            writer_sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return !logger::log_queue.empty()
+                   || !logger::urgent_queue.empty()
+                   || logger::producers_size > 0 || throttle_pending
+                   || writer_cpu_pending() > 0
+                   || logger::stats_interval != interval
+                   || logger::close_writer.load();
+        };
+        if (exporter.next != std::chrono::steady_clock::time_point{})
+            logger::log_cv.wait_until(lock, exporter.next, ready);
+        else
+            logger::log_cv.wait(lock, ready);
+        writer_sleeping.store(false, std::memory_order_relaxed);
+        if (writer_cpu_pending() > 0)
+        {
+            drain_cpu_queues();
+            logger::queue_high_water =
+                std::max(logger::queue_high_water, pending());
+            update_overload(pending());
+        }
+        if (logger::producers_size > 0 || throttle_pending)
+            schedule_fair();
+        keep_warm(batch);
+        std::swap(batch, logger::log_queue);
+        logger::in_flight = batch.size();
+        bool has_urgent = !logger::urgent_queue.empty();
+        interval = logger::stats_interval;
+        lock.unlock();
+
+        if (!batch.empty() || has_urgent)
+        {
+            std::lock_guard<std::mutex> sinks(logger::sink_mutex);
+            write_urgent(urgent);
+            while (!batch.empty())
+            {
+                // An urgent record waits for one record of the backlog
+                if (urgent_pending.load(std::memory_order_relaxed))
+                    write_urgent(urgent);
+                if (!write_front(batch))
+                    break;
+            }
+            if (writer_abandoned())
+                return;
+            lock.lock();
+            logger::in_flight = 0;
+            update_overload(pending());
+            lock.unlock();
+        }
+
+        if (logger::close_writer.load())
+        {
+            lock.lock();
+            if (logger::log_queue.empty() && logger::urgent_queue.empty()
+                && logger::producers_size == 0 && writer_cpu_pending() == 0)
+                break;
+            if (past_shutdown_deadline())
+            {
+                last_shutdown.discarded += logger::log_queue.size()
+                                           + logger::urgent_queue.size()
+                                           + clear_producers()
+                                           + clear_cpu_queues();
+                last_shutdown.deadline_expired = true;
+                logger::log_queue.clear();
+                logger::urgent_queue.clear();
+                break;
+            }
+            continue;
+        }
+        exporter.run(interval);
+    }
+    sync_sinks();
+}
+
+void oak::set_level(const level &lvl)
 {
     std::lock_guard<std::mutex> lock(logger::log_mutex);
-    if (logger::log_file.is_open())
-        logger::log_file.close();
+    logger::base_level = lvl;
+    apply_overload_step();
 }
 
-#ifdef OAK_USE_SOCKETS
-void oak::close_socket()
+void oak::set_overload(std::size_t high, std::size_t low,
+                       overload_action action, unsigned sample)
 {
     std::lock_guard<std::mutex> lock(logger::log_mutex);
-    if (logger::log_socket > 0)
-        close(logger::log_socket);
+    logger::overload_high = high;
+    logger::overload_low = low < high ? low : high / 2;
+    logger::overload_act = action;
+    logger::overload_sample = sample;
+    if (high == 0)
+        logger::overload_step = 0;
+    apply_overload_step();
+}
+
+void oak::add_sink(std::shared_ptr<sink> s)
+{
+    std::lock_guard<std::mutex> lock(logger::sink_mutex);
+    logger::sinks.push_back(std::move(s));
+}
+
+void oak::remove_sink(const std::shared_ptr<sink> &s)
+{
+    std::lock_guard<std::mutex> lock(logger::sink_mutex);
+    std::erase(logger::sinks, s);
 }
-#endif
 
-void oak::add_to_queue(const std::string &str, const destination &d)
+void oak::set_stats_export(std::chrono::milliseconds interval,
+                           const std::string &file, bool log_line)
 {
     {
         std::lock_guard<std::mutex> lock(logger::log_mutex);
-        logger::log_queue.push_back({str, d});
+        logger::stats_interval = interval;
+        logger::stats_file = file;
+        logger::stats_log = log_line;
     }
     logger::log_cv.notify_one();
 }
 
-void oak::writer()
+std::string oak::to_prometheus(const stats_snapshot &snap)
 {
-    while (!logger::close_writer.load())
+    static const char *level_names[] = {"debug", "info",   "warn",
+                                        "error", "output", "disabled"};
+    static const char *sink_names[] = {"stdout", "file", "socket", "custom"};
+    std::ostringstream out;
+
+    auto summary = [&out](const std::string &name, const histogram &h,
+                          const std::string &labels)
     {
-        std::unique_lock<std::mutex> lock(logger::log_mutex);
-        logger::log_cv.wait(lock,
-                            [] {
-                                return !logger::log_queue.empty()
-                                       || logger::close_writer.load();
-                            });
-        while (!logger::log_queue.empty())
-        {
-            auto elem = logger::log_queue.front();
-            logger::log_queue.pop_front();
-            switch (elem.dest)
-            {
-            case oak::destination::std_out:
-                std::cout << elem.message;
-                break;
-            case oak::destination::file:
-                logger::log_file << elem.message;
-                break;
-            case oak::destination::socket:
-#ifdef OAK_USE_SOCKETS
-                write(logger::log_socket, elem.message.c_str(),
-                      elem.message.size());
+        std::string sep = labels.empty() ? "" : ",";
+        for (double q : {50.0, 90.0, 99.0, 99.9})
+            out << name << "{" << labels << sep << "quantile=\""
+                << q / 100 << "\"} "
+                << static_cast<double>(h.percentile(q)) / 1e9 << "\n";
+        out << name << "_sum";
+        if (!labels.empty())
+            out << "{" << labels << "}";
+        out << " " << static_cast<double>(h.sum) / 1e9 << "\n";
+        out << name << "_count";
+        if (!labels.empty())
+            out << "{" << labels << "}";
+        out << " " << h.count << "\n";
+    };
+
+    out << "# HELP oak_messages_total Messages enqueued.\n"
+        << "# TYPE oak_messages_total counter\n";
+    for (std::size_t i = 0; i < num_levels - 1; ++i)
+        out << "oak_messages_total{level=\"" << level_names[i] << "\"} "
+            << snap.messages[i] << "\n";
+    out << "# HELP oak_bytes_total Bytes enqueued.\n"
+        << "# TYPE oak_bytes_total counter\n";
+    for (std::size_t i = 0; i < num_levels - 1; ++i)
+        out << "oak_bytes_total{level=\"" << level_names[i] << "\"} "
+            << snap.bytes[i] << "\n";
+    out << "# HELP oak_drops_total Messages dropped.\n"
+        << "# TYPE oak_drops_total counter\n"
+        << "oak_drops_total " << snap.drops << "\n";
+    out << "# HELP oak_direct_writes_total Messages written by the caller.\n"
+        << "# TYPE oak_direct_writes_total counter\n"
+        << "oak_direct_writes_total " << snap.direct_writes << "\n";
+    out << "# HELP oak_queue_depth Messages waiting for the writer.\n"
+        << "# TYPE oak_queue_depth gauge\n"
+        << "oak_queue_depth " << snap.queue_depth << "\n";
+    out << "# HELP oak_queue_high_water Maximum queue depth.\n"
+        << "# TYPE oak_queue_high_water gauge\n"
+        << "oak_queue_high_water " << snap.queue_high_water << "\n";
+    out << "# HELP oak_enqueue_wait_seconds Time to enqueue a message.\n"
+        << "# TYPE oak_enqueue_wait_seconds summary\n";
+    summary("oak_enqueue_wait_seconds", snap.enqueue_wait, "");
+    out << "# HELP oak_writer_lag_seconds Time from enqueue to write.\n"
+        << "# TYPE oak_writer_lag_seconds summary\n";
+    summary("oak_writer_lag_seconds", snap.writer_lag, "");
+
+    out << "# HELP oak_sink_writes_total Writes to a sink.\n"
+        << "# TYPE oak_sink_writes_total counter\n";
+    for (std::size_t i = 0; i < num_sinks; ++i)
+        out << "oak_sink_writes_total{sink=\"" << sink_names[i] << "\"} "
+            << snap.sinks[i].writes << "\n";
+    out << "# HELP oak_sink_bytes_total Bytes written to a sink.\n"
+        << "# TYPE oak_sink_bytes_total counter\n";
+    for (std::size_t i = 0; i < num_sinks; ++i)
+        out << "oak_sink_bytes_total{sink=\"" << sink_names[i] << "\"} "
+            << snap.sinks[i].bytes << "\n";
+    out << "# HELP oak_sink_errors_total Failed writes to a sink.\n"
+        << "# TYPE oak_sink_errors_total counter\n";
+    for (std::size_t i = 0; i < num_sinks; ++i)
+        out << "oak_sink_errors_total{sink=\"" << sink_names[i] << "\"} "
+            << snap.sinks[i].errors << "\n";
+    out << "# HELP oak_sink_write_seconds Latency of a sink write.\n"
+        << "# TYPE oak_sink_write_seconds summary\n";
+    for (std::size_t i = 0; i < num_sinks; ++i)
+        summary("oak_sink_write_seconds", snap.sinks[i].latency,
+                std::string("sink=\"") + sink_names[i] + "\"");
+    return out.str();
+}
+
+namespace
+{
+
+// Whether the writer ran when the process forked
+bool writer_ran_at_fork = false;
+
+/*
+ * Runs in the forking thread before fork(): the writer gets a bounded
+ * time to drain the queue, then every lock is taken and the stream
+ * buffers are flushed, so that the child inherits consistent state and
+ * no record of the parent.
+ */
+void prepare_fork()
+{
+    using namespace std::chrono_literals;
+    writer_ran_at_fork = logger::writer_thread.has_value()
+                         && logger::writer_thread->joinable()
+                         && !logger::close_writer.load();
+    auto deadline = std::chrono::steady_clock::now() + 1s;
+    while (writer_ran_at_fork && queue_size() > 0
+           && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(100us);
+
+    logger::sink_mutex.lock();
+    logger::log_mutex.lock();
+#ifdef OAK_USE_STATS
+    stats_mutex.lock();
 #endif
-                break;
-            default:
-                break;
-            }
-        }
+    std::cout << std::flush;
+    if (logger::log_file.is_open())
+        logger::log_file << std::flush;
+}
+
+void parent_after_fork()
+{
+#ifdef OAK_USE_STATS
+    stats_mutex.unlock();
+#endif
+    logger::log_mutex.unlock();
+    logger::sink_mutex.unlock();
+}
+
+// The child only has the forking thread, the writer must be restarted
+void child_after_fork()
+{
+    // The parent's writer may be counted as a waiter on the condition
+    // variable, a notify would go to it: start from a fresh one
+    new (&logger::log_cv) std::condition_variable();
+    new (&writer_done_mutex) std::mutex();
+    new (&writer_done_cv) std::condition_variable();
+
+    // Left to the parent, which still writes them
+    logger::log_queue.clear();
+    logger::urgent_queue.clear();
+    clear_producers();
+    // A spinlock may have been held by a thread that is not here
+    for (auto *q : logger::cpu_queues)
+    {
+        q->lock.clear();
+        q->draining.clear();
+        q->spare.clear();
+    }
+    clear_cpu_queues();
+    // Only the forking thread has a producer queue here
+    std::erase_if(logger::producers, [](const auto &p)
+                  { return p.get() != local_producer.queue; });
+    logger::producer_next = 0;
+    logger::in_flight = 0;
+    if (logger::writer_thread.has_value() && logger::writer_thread->joinable())
+    {
+        // The parent's writer does not exist here and joining it would
+        // never return: its handle is leaked on purpose
+        (void) new std::jthread(std::move(*logger::writer_thread));
+    }
+    logger::writer_thread.reset();
+    logger::writer_running = false;
+    for (auto &w : node_writers)
+    {
+        new (&w->mutex) std::mutex();
+        new (&w->cv) std::condition_variable();
+        if (w->thread.has_value() && w->thread->joinable())
+            (void) new std::jthread(std::move(*w->thread));
+        w->thread.reset();
+        w->sleeping = false;
+        w->in_flight = 0;
+        w->file.close();
+        // The sidecars are the parent's, their open segment is dropped
+        if (w->index.fd >= 0)
+            close(w->index.fd);
+        w->index = {};
+        if (w->search.fd >= 0)
+            close(w->search.fd);
+        w->search = {};
     }
+    node_writers_running = false;
+
+    if (logger::per_process_files && logger::log_file.is_open())
+    {
+        auto path = std::format("{}.{}", logger::log_file_path, getpid());
+        logger::log_file.close();
+        logger::log_file.open(path, std::ios::app);
+        logger::log_file_path = path;
+        open_file_index(file_index, path);
+        open_search_index(search_index, path);
+    }
+
+#ifdef OAK_USE_STATS
+    stats_mutex.unlock();
+#endif
+    logger::log_mutex.unlock();
+    logger::sink_mutex.unlock();
+
+    if (writer_ran_at_fork)
+        init_writer();
+}
+
+// Drains the queue if the program exits without stop_writer()
+void stop_at_exit()
+{
+    auto report = stop_writer();
+    if (report.discarded > 0)
+        std::cerr << std::format("oak: {} records discarded at exit\n",
+                                 report.discarded);
 }
 
+} // namespace
+
 void oak::init_writer()
 {
-    logger::writer_thread.emplace([] { writer(); });
+    static std::once_flag handlers;
+    std::call_once(handlers,
+                   []
+                   {
+                       pthread_atfork(prepare_fork, parent_after_fork,
+                                      child_after_fork);
+                       std::atexit(stop_at_exit);
+                   });
+    logger::close_writer = false;
+    {
+        std::lock_guard<std::mutex> lock(writer_done_mutex);
+        writer_done = false;
+    }
+    logger::writer_thread.emplace(
+        [](std::stop_token stop)
+        {
+            writer_token = stop;
+            writer();
+            if (stop.stop_requested())
+                return;
+            {
+                std::lock_guard<std::mutex> lock(writer_done_mutex);
+                writer_done = true;
+            }
+            writer_done_cv.notify_all();
+        });
+    logger::writer_running = true;
+    start_node_writers();
+}
+
+int oak::numa_nodes()
+{
+#ifdef OAK_USE_NUMA
+    if (numa_enabled())
+        return numa_max_node() + 1;
+#endif
+    return 1;
+}
+
+std::expected<int, std::string> oak::warmup(const warmup_options &options)
+{
+    auto records = options.records;
+    auto bytes = options.record_size;
+    // Advised before the first write, so that the faults map huge pages
+    memory_advice advise = options.huge_pages ? advise_huge_pages : nullptr;
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        logger::warm_records = std::max(logger::warm_records.load(), records);
+        logger::warm_bytes = std::max(logger::warm_bytes.load(), bytes);
+        if (options.huge_pages)
+            logger::warm_huge_pages = true;
+        std::vector<record_queue *> rings = {&logger::log_queue,
+                                             &logger::urgent_queue};
+        auto order = logger::order.load(std::memory_order_relaxed);
+        if (order == ordering::fair)
+            rings.push_back(&thread_producer().records);
+        for (auto *ring : rings)
+            ring->reserve(records, bytes, advise);
+        if (order == ordering::per_cpu)
+        {
+            // Both rings of a queue, from a thread of its node
+            for (int node = 0; node < numa_nodes(); ++node)
+                on_node(node,
+                        [&]
+                        {
+                            for (auto *q : logger::cpu_queues)
+                            {
+                                if (q->node != node)
+                                    continue;
+                                lock_cpu_queue(*q);
+                                q->records.reserve(records, bytes, advise);
+                                q->lock.clear(std::memory_order_release);
+                                while (q->draining.test_and_set(
+                                    std::memory_order_acquire))
+                                    std::this_thread::yield();
+                                q->spare.reserve(records, bytes, advise);
+                                q->draining.clear(std::memory_order_release);
+                            }
+                        });
+        }
+    }
+    // The writer warms its rings before it takes the next batch
+    logger::log_cv.notify_one();
+
+    auto &buffer = thread_buffer();
+    if (buffer.capacity() < bytes)
+    {
+        buffer.reserve(bytes);
+        if (advise)
+            advise({buffer.data(), buffer.capacity()});
+    }
+    buffer.assign(buffer.capacity(), '\0');
+    buffer.clear();
+    thread_backlog().reserve(bytes, advise);
+
+    if (options.lock && mlockall(MCL_CURRENT) != 0)
+        return std::unexpected(
+            std::format("mlockall: {}", std::strerror(errno)));
+    return 0;
 }
 
-void oak::stop_writer()
+oak::shutdown_report oak::stop_writer()
 {
-    logger::close_writer = true;
+    if (!logger::writer_thread.has_value()
+        || !logger::writer_thread->joinable())
+        return {};
+    std::chrono::steady_clock::time_point until;
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        last_shutdown.reset();
+        rejected = 0;
+        closing = true;
+        shutdown_until =
+            std::chrono::steady_clock::now() + logger::shutdown_deadline;
+        until = shutdown_until;
+        logger::close_writer = true;
+    }
+    // Their leftovers go to the main writer
+    stop_node_writers();
     logger::log_cv.notify_one();
-    if (logger::writer_thread.has_value())
-        logger::writer_thread.value().join();
+    bool done;
+    {
+        std::unique_lock<std::mutex> lock(writer_done_mutex);
+        done = writer_done_cv.wait_until(lock, until + writer_grace,
+                                         [] { return writer_done; });
+    }
+    if (done)
+        logger::writer_thread->join();
+    else
+    {
+        // Blocked in a sink: it returns on its own once the sink does,
+        // and what it holds, the record in the sink included, is lost
+        logger::writer_thread->request_stop();
+        logger::writer_thread->detach();
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        last_shutdown.discarded +=
+            logger::log_queue.size() + logger::urgent_queue.size()
+            + clear_producers() + clear_cpu_queues()
+            + logger::in_flight.exchange(0);
+        last_shutdown.deadline_expired = true;
+        logger::log_queue.clear();
+        logger::urgent_queue.clear();
+    }
+    logger::writer_thread.reset();
+    logger::writer_running = false;
+
+    shutdown_report report;
+    report.drained = last_shutdown.drained;
+    report.discarded = last_shutdown.discarded + rejected.exchange(0);
+    report.deadline_expired = last_shutdown.deadline_expired;
+    closing = false;
+    return report;
 }
 
 [[nodiscard]] std::expected<int, std::string> oak::settings_file(
@@ -143,6 +3456,22 @@ void oak::stop_writer()
         return std::unexpected("Settings file does not exist");
     }
 
+    // The overload keys are validated together and applied once, at the
+    // end; a key that is not in the file keeps its value
+    bool overload = false;
+    bool overload_low_set = false;
+    std::size_t overload_high;
+    std::size_t overload_low;
+    overload_action overload_act;
+    unsigned overload_sample;
+    {
+        std::lock_guard<std::mutex> lock(logger::log_mutex);
+        overload_high = logger::overload_high;
+        overload_low = logger::overload_low;
+        overload_act = logger::overload_act;
+        overload_sample = logger::overload_sample;
+    }
+
     std::ifstream settings(file);
     while (!settings.eof())
     {
@@ -194,6 +3523,8 @@ void oak::stop_writer()
                     add_flags(flags::tid);
                 else if (flag == "json")
                     add_flags(flags::json);
+                else if (flag == "seq")
+                    add_flags(flags::seq);
                 else
                     return std::unexpected("Invalid flags in file");
             }
@@ -212,6 +3543,8 @@ void oak::stop_writer()
                 add_flags(flags::tid);
             else if (value == "json")
                 add_flags(flags::json);
+            else if (value == "seq")
+                add_flags(flags::seq);
             else
                 return std::unexpected("Invalid flags in file");
         }
@@ -223,26 +3556,250 @@ void oak::stop_writer()
                 return std::unexpected("Could not open file");
             }
         }
+        else if (key == "file_format")
+        {
+            if (value == "text")
+                set_file_format(file_format::text);
+            else if (value == "framed")
+                set_file_format(file_format::framed);
+            else
+                return std::unexpected("Invalid file format in file");
+        }
+        else if (key == "file_index_records" || key == "file_index_bytes")
+        {
+            std::lock_guard<std::mutex> lock(logger::sink_mutex);
+            try
+            {
+                if (key == "file_index_records")
+                    logger::index_records = std::stoul(value);
+                else
+                    logger::index_bytes = std::stoul(value);
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid file index in file");
+            }
+        }
+        else if (key == "search_segment_bytes"
+                 || key == "search_filter_bytes")
+        {
+            std::lock_guard<std::mutex> lock(logger::sink_mutex);
+            try
+            {
+                if (key == "search_segment_bytes")
+                    logger::search_segment_bytes = std::stoul(value);
+                else
+                    logger::search_filter_bytes = std::stoul(value);
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid search index in file");
+            }
+        }
+        else if (key == "stats_interval")
+        {
+            std::lock_guard<std::mutex> lock(logger::log_mutex);
+            try
+            {
+                logger::stats_interval =
+                    std::chrono::milliseconds(std::stoul(value));
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid stats interval in file");
+            }
+        }
+        else if (key == "per_process_files")
+        {
+            if (value == "on")
+                set_per_process_files(true);
+            else if (value == "off")
+                set_per_process_files(false);
+            else
+                return std::unexpected("Invalid per process files in file");
+        }
+        else if (key == "backlog_level")
+        {
+            auto size = logger::backlog_size.load();
+            if (value == "debug")
+                set_backlog(level::debug, size > 0 ? size : 256);
+            else if (value == "info")
+                set_backlog(level::info, size > 0 ? size : 256);
+            else if (value == "warn")
+                set_backlog(level::warn, size > 0 ? size : 256);
+            else if (value == "disabled")
+                set_backlog(level::disabled, 0);
+            else
+                return std::unexpected("Invalid backlog level in file");
+        }
+        else if (key == "backlog_size")
+        {
+            try
+            {
+                logger::backlog_size = std::stoul(value);
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid backlog size in file");
+            }
+        }
+        else if (key == "ordering")
+        {
+            if (value == "strict")
+                set_ordering(ordering::strict);
+            else if (value == "priority")
+                set_ordering(ordering::priority);
+            else if (value == "priority_flush")
+                set_ordering(ordering::priority, true);
+            else if (value == "fair")
+                set_ordering(ordering::fair);
+            else if (value == "per_cpu")
+                set_ordering(ordering::per_cpu);
+            else
+                return std::unexpected("Invalid ordering in file");
+        }
+        else if (key == "write_mode")
+        {
+            if (value == "automatic")
+                set_write_mode(write_mode::automatic);
+            else if (value == "queued")
+                set_write_mode(write_mode::queued);
+            else if (value == "direct")
+                set_write_mode(write_mode::direct);
+            else if (value == "hybrid")
+                set_write_mode(write_mode::hybrid);
+            else
+                return std::unexpected("Invalid write mode in file");
+        }
+        else if (key == "shutdown_deadline")
+        {
+            try
+            {
+                set_shutdown_deadline(
+                    std::chrono::milliseconds(std::stoul(value)));
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid shutdown deadline in file");
+            }
+        }
+        else if (key == "overload_high" || key == "overload_low"
+                 || key == "overload_sample")
+        {
+            try
+            {
+                auto n = std::stoul(value);
+                if (key == "overload_high")
+                    overload_high = n;
+                else if (key == "overload_low")
+                {
+                    overload_low = n;
+                    overload_low_set = true;
+                }
+                else if (n > 0 && n <= std::numeric_limits<unsigned>::max())
+                    overload_sample = static_cast<unsigned>(n);
+                else
+                    return std::unexpected(
+                        "Invalid overload setting in file");
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid overload setting in file");
+            }
+            overload = true;
+        }
+        else if (key == "writer_node")
+        {
+            try
+            {
+                set_writer_node(std::stoi(value));
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid writer node in file");
+            }
+        }
+        else if (key == "node_writers")
+        {
+            if (value == "on")
+                set_node_writers(true);
+            else if (value == "off")
+                set_node_writers(false);
+            else
+                return std::unexpected("Invalid node writers in file");
+        }
+        else if (key == "producer_quota")
+        {
+            try
+            {
+                set_producer_quota(std::stoul(value));
+            }
+            catch (const std::exception &e)
+            {
+                return std::unexpected("Invalid producer quota in file");
+            }
+        }
+        else if (key == "overload_action")
+        {
+            if (value == "raise_level")
+                overload_act = overload_action::raise_level;
+            else if (value == "sample")
+                overload_act = overload_action::sample;
+            else
+                return std::unexpected("Invalid overload action in file");
+            overload = true;
+        }
+        else if (key == "stats_file")
+        {
+            std::lock_guard<std::mutex> lock(logger::log_mutex);
+            logger::stats_file = value;
+        }
+        else if (key == "stats_log")
+        {
+            std::lock_guard<std::mutex> lock(logger::log_mutex);
+            if (value == "on")
+                logger::stats_log = true;
+            else if (value == "off")
+                logger::stats_log = false;
+            else
+                return std::unexpected("Invalid stats log in file");
+        }
         else
         {
             return std::unexpected("Invalid key in file");
         }
     }
 
+    if (overload)
+    {
+        // A new high without a low takes the default of set_overload()
+        if (!overload_low_set && overload_high > 0)
+            overload_low = overload_high / 2;
+        if (overload_high > 0 && overload_low >= overload_high)
+            return std::unexpected("Invalid overload setting in file");
+        set_overload(overload_high, overload_low, overload_act,
+                     overload_sample);
+    }
+
     return 0;
 }
 
+void oak::log_to_stdout(const std::string &str)
+{
+    submit(str, oak::destination::std_out, level::output, false, 0);
+}
+
 void oak::log_to_file(const std::string &str)
 {
     if (is_file_open())
-        add_to_queue(str, oak::destination::file);
+        submit(str, oak::destination::file, level::output, false, 0);
 }
 
 #ifdef OAK_USE_SOCKETS
 void oak::log_to_socket(const std::string &str)
 {
     if (logger::log_socket > 0)
-        add_to_queue(str, oak::destination::socket);
+        submit(str, oak::destination::socket, level::output, false, 0);
 }
 #endif
 
@@ -251,7 +3808,7 @@ void oak::log_to_socket(const std::string &str)
 [[nodiscard]] std::expected<int, std::string>
 oak::set_socket(const std::string &sock_addr)
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    std::scoped_lock lock(logger::sink_mutex, logger::log_mutex);
     if (sock_addr.size() > 108)
     {
         return std::unexpected("Socket address too long, max 108 characters");
@@ -285,7 +3842,7 @@ oak::set_socket(const std::string &sock_addr)
 oak::set_socket(const std::string &addr, short unsigned int port,
            const protocol_t &protocol)
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    std::scoped_lock lock(logger::sink_mutex, logger::log_mutex);
     if (logger::log_socket > 0)
     {
         close(logger::log_socket);
@@ -330,10 +3887,13 @@ oak::set_socket(const std::string &addr, short unsigned int port,
 
 void oak::flush()
 {
-    std::lock_guard<std::mutex> lock(logger::log_mutex);
+    OAK_PROBE(flush, level::output, queue_size(), logger::sequence.load());
+    std::lock_guard<std::mutex> lock(logger::sink_mutex);
     std::cout << std::flush;
     if (logger::log_file.is_open())
         logger::log_file << std::flush;
+    for (auto &s : logger::sinks)
+        s->flush();
 }
 
 std::string oak::apply_color(const level &lvl, const std::string &str)
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "oak/oak.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * Test-only sink that injects faults: a delay on every write, partial
+ * writes of at most `max_write` bytes, EAGAIN or EIO every n writes, and
+ * a stall that blocks every write until release() is called. The bytes
+ * that were accepted are kept in data(), wait_lines() waits for them.
+ */
+class faulty_sink : public oak::sink
+{
+  public:
+    std::atomic<long> delay_us = 0;
+    std::atomic<std::size_t> max_write = 0; // 0 = no partial writes
+    std::atomic<int> eagain_every = 0;      // 0 = never
+    std::atomic<int> error_every = 0;       // 0 = never
+
+    ssize_t write(const char *buf, std::size_t size) override
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stalls++;
+            cv.wait(lock, [this] { return !stalled; });
+        }
+        if (delay_us.load() > 0)
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(delay_us.load()));
+
+        int n = ++calls;
+        if (error_every.load() > 0 && n % error_every.load() == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (eagain_every.load() > 0 && n % eagain_every.load() == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (max_write.load() > 0 && size > max_write.load())
+            size = max_write.load();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            content.append(buf, size);
+            lines +=
+                static_cast<std::size_t>(std::count(buf, buf + size, '\n'));
+        }
+        cv.notify_all();
+        return static_cast<ssize_t>(size);
+    }
+
+    // Waits until data() holds `n` lines, false after `timeout`
+    bool wait_lines(std::size_t n, std::chrono::milliseconds timeout =
+                                       std::chrono::seconds(10))
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv.wait_for(lock, timeout, [&] { return lines >= n; });
+    }
+
+    void stall()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stalled = true;
+        stalls = 0;
+    }
+
+    void release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stalled = false;
+        }
+        cv.notify_all();
+    }
+
+    // Writes that reached the sink since the last stall()
+    int stalled_writes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stalls;
+    }
+
+    std::string data()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return content;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        content.clear();
+        lines = 0;
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stalled = false;
+    int stalls = 0;
+    std::atomic<int> calls = 0;
+    std::string content;
+    std::size_t lines = 0;
+};
@@ -0,0 +1,251 @@
+/*
+ * Zero allocation tests: the global operator new and malloc are
+ * replaced with counting versions, and steady state oak::log calls must
+ * not allocate on the calling thread.
+ */
+
+#include "oak/oak.hpp"
+#include "test.hpp"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <new>
+#include <unistd.h>
+
+extern int errors;
+extern int num_assertions;
+
+namespace
+{
+// Constant initialized, usable before any dynamic initialization
+thread_local bool counting = false;
+thread_local std::size_t allocations = 0;
+
+inline void count()
+{
+    if (counting)
+        allocations++;
+}
+
+inline void *counted_new(std::size_t size)
+{
+    count();
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+inline void *counted_new(std::size_t size, std::align_val_t align)
+{
+    count();
+    auto a = static_cast<std::size_t>(align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+} // namespace
+
+void *operator new(std::size_t size)
+{
+    return counted_new(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return counted_new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return counted_new(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return counted_new(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+    return counted_new(size, align);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align)
+{
+    return counted_new(size, align);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+#ifdef __GLIBC__
+// Interpose malloc as well, to catch the allocations that bypass new
+extern "C"
+{
+    void *__libc_malloc(std::size_t size);
+    void *__libc_calloc(std::size_t n, std::size_t size);
+    void *__libc_realloc(void *p, std::size_t size);
+
+    void *malloc(std::size_t size)
+    {
+        count();
+        return __libc_malloc(size);
+    }
+
+    void *calloc(std::size_t n, std::size_t size)
+    {
+        count();
+        return __libc_calloc(n, size);
+    }
+
+    void *realloc(void *p, std::size_t size)
+    {
+        count();
+        return __libc_realloc(p, size);
+    }
+}
+#endif
+
+namespace
+{
+
+void wait_drained()
+{
+    using namespace std::chrono_literals;
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+}
+
+/*
+ * Runs rounds of `calls` until the queue ring and every buffer reached
+ * their steady size, and returns the allocations of the first round
+ * after that: an allocation in every call never reaches zero.
+ */
+template <typename F> std::size_t steady_state_allocations(F &&f)
+{
+    constexpr int calls = 500;
+    std::size_t last = 0;
+    for (int round = 0; round < 16; ++round)
+    {
+        wait_drained();
+        allocations = 0;
+        counting = true;
+        for (int i = 0; i < calls; ++i)
+            f(i);
+        counting = false;
+        last = allocations;
+        if (last == 0)
+            break;
+    }
+    return last;
+}
+
+} // namespace
+
+void test_zero_allocations()
+{
+    // Keep the thousands of records out of the terminal
+    std::cout << std::flush;
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    std::string host = "example.org";
+
+    oak::set_level(oak::level::error);
+    auto filtered = steady_state_allocations(
+        [&host](int i) { oak::debug("filtered {} {} {}", i, 3.5, host); });
+
+    // Kept in the backlog: captured, not formatted
+    oak::set_backlog(oak::level::debug, 64);
+    auto backlog = steady_state_allocations(
+        [](int i) { oak::debug("kept {} {} {}", i, 3.5, "short"); });
+    oak::set_backlog(oak::level::disabled, 0);
+
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::level, oak::flags::date, oak::flags::time,
+                   oak::flags::pid, oak::flags::tid);
+    auto text = steady_state_allocations(
+        [&host](int i)
+        {
+            oak::info("request {} from {} took {} ms, status {}", i, host,
+                      3.25, "ok");
+        });
+
+    oak::set_flags(oak::flags::json, oak::flags::level, oak::flags::date,
+                   oak::flags::time, oak::flags::pid, oak::flags::tid);
+    auto json = steady_state_allocations(
+        [&host](int i)
+        {
+            oak::info("request {} from {} took {} ms, status {}", i, host,
+                      3.25, "ok");
+        });
+
+    oak::set_flags(oak::flags::level, oak::flags::color);
+    auto color = steady_state_allocations(
+        [](int i) { oak::warn("warning {}", i); });
+
+    wait_drained();
+    oak::flush();
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+    oak::set_flags(oak::flags::level);
+
+    ASSERT_EQ(filtered, 0);
+    ASSERT_EQ(backlog, 0);
+    ASSERT_EQ(text, 0);
+    ASSERT_EQ(json, 0);
+    ASSERT_EQ(color, 0);
+}
@@ -1,16 +1,43 @@
 #include "oak/oak.hpp"
+#include "faulty_sink.hpp"
 #include "test.hpp"
 
 #include <chrono>
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <cmath>
 #include <errno.h>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <thread>
+#include <vector>
 
 int errors = 0;
 int num_assertions = 0;
 
+// oak_alloc_tests.cpp
+void test_zero_allocations();
+
+// Polls `done` until it holds, false after `timeout`
+template <typename F>
+bool wait_until(F &&done,
+                std::chrono::milliseconds timeout = std::chrono::seconds(10))
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+
 void test_getters()
 {
     // default values
@@ -66,6 +93,12 @@ void test_settings_file()
     ASSERT_EQ(oak::get_level(), oak::level::info);
     ASSERT_EQ(oak::get_flags(), 2);
     ASSERT_EQ(oak::is_file_open(), true);
+
+    // A low above the high is refused, and nothing of it is applied
+    ret = oak::settings_file("tests/test_settings3.oak");
+    ASSERT(!ret.has_value());
+    ASSERT_EQ(oak::logger::overload_high, 0);
+    ASSERT(oak::logger::overload_act == oak::overload_action::raise_level);
 }
 
 void test_file()
@@ -98,6 +131,217 @@ void test_file()
     std::filesystem::remove("tests/test_out.txt");
 }
 
+void test_framed_file()
+{
+    ASSERT_EQ(oak::crc32c("123456789", 9), 0xe3069283u);
+    ASSERT_EQ(oak::crc32c("56789", 5, oak::crc32c("1234", 4)), 0xe3069283u);
+    std::string big(1000, 'x');
+    ASSERT_EQ(oak::crc32c(big.data(), big.size()),
+              oak::crc32c(big.data() + 3, big.size() - 3,
+                          oak::crc32c(big.data(), 3)));
+
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    oak::set_write_mode(oak::write_mode::direct);
+    std::filesystem::remove("tests/framed_test.log");
+    oak::set_file_format(oak::file_format::framed);
+    auto exp = oak::set_file("tests/framed_test.log");
+    ASSERT(exp.has_value());
+    std::string expected;
+    for (int i = 0; i < 100; ++i)
+    {
+        oak::log_to_file(oak::level::info, "framed {}", i);
+        expected += std::format("framed {}\n", i);
+    }
+    oak::close_file();
+    ASSERT(oak::is_framed_file("tests/framed_test.log"));
+    auto contents = oak::read_framed_file("tests/framed_test.log");
+    ASSERT(contents.has_value());
+    ASSERT_EQ(contents->records, expected);
+    ASSERT_EQ(contents->count, 100);
+    ASSERT_EQ(contents->corrupted, 0);
+    auto size = std::filesystem::file_size("tests/framed_test.log");
+
+    // A torn tail, a partial record then pages never written
+    {
+        std::ofstream file("tests/framed_test.log",
+                           std::ios::app | std::ios::binary);
+        oak::frame_header frame;
+        frame.size = 100;
+        file.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
+        file << "partial";
+        file << std::string(4096, '\0');
+    }
+    auto recovered = oak::recover_framed_file("tests/framed_test.log");
+    ASSERT(recovered.has_value());
+    ASSERT_EQ(recovered->size, size);
+    ASSERT_EQ(recovered->truncated, sizeof(oak::frame_header) + 7 + 4096);
+    ASSERT_EQ(std::filesystem::file_size("tests/framed_test.log"), size);
+
+    // A corrupted record in the middle is skipped
+    {
+        std::fstream file("tests/framed_test.log",
+                          std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(size / 2));
+        file.put('#');
+    }
+    contents = oak::read_framed_file("tests/framed_test.log");
+    ASSERT_EQ(contents->count, 99);
+    ASSERT(contents->corrupted > 0);
+    ASSERT(contents->records.ends_with("framed 99\n"));
+
+    // set_file cuts a torn tail before appending
+    {
+        std::ofstream file("tests/framed_test.log", std::ios::app);
+        file << "torn";
+    }
+    exp = oak::set_file("tests/framed_test.log");
+    ASSERT(exp.has_value());
+    oak::log_to_file(oak::level::info, "after recovery");
+    oak::close_file();
+    contents = oak::read_framed_file("tests/framed_test.log");
+    ASSERT(contents->records.ends_with("framed 99\nafter recovery\n"));
+
+    // A text file is not recovered
+    std::ofstream("tests/framed_test.txt") << "plain\n";
+    ASSERT(!oak::recover_framed_file("tests/framed_test.txt").has_value());
+    ASSERT(!oak::set_file("tests/framed_test.txt").has_value());
+    oak::set_file_format(oak::file_format::text);
+    oak::set_write_mode(oak::write_mode::automatic);
+    std::filesystem::remove("tests/framed_test.txt");
+    std::filesystem::remove("tests/framed_test.log");
+}
+
+void test_file_index()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    oak::set_write_mode(oak::write_mode::direct);
+    oak::set_file_index(10);
+    for (auto format : {oak::file_format::text, oak::file_format::framed})
+    {
+        std::filesystem::remove("tests/index_test.log");
+        std::filesystem::remove("tests/index_test.log.idx");
+        oak::set_file_format(format);
+        auto exp = oak::set_file("tests/index_test.log");
+        ASSERT(exp.has_value());
+        std::string before, after;
+        for (int i = 0; i < 50; ++i)
+        {
+            oak::log_to_file(oak::level::info, "before {}", i);
+            if (i >= 40)
+                before += std::format("before {}\n", i);
+        }
+        std::this_thread::sleep_for(10ms);
+        auto middle = std::chrono::system_clock::now();
+        std::this_thread::sleep_for(10ms);
+        for (int i = 0; i < 50; ++i)
+        {
+            oak::log_to_file(oak::level::info, "after {}", i);
+            after += std::format("after {}\n", i);
+        }
+        oak::close_file();
+
+        auto index = oak::read_file_index("tests/index_test.log");
+        ASSERT(index.has_value());
+        ASSERT_EQ(index->size(), 10);
+        ASSERT_EQ(index->front().offset, 0);
+        ASSERT(std::is_sorted(index->begin(), index->end(),
+                              [](auto &a, auto &b)
+                              { return a.offset < b.offset; }));
+
+        // From the entry before `middle`, every 10 records
+        std::string text;
+        auto append = [&text](std::string_view s) { text += s; };
+        auto r = oak::read_time_range(
+            "tests/index_test.log", middle,
+            std::chrono::system_clock::time_point::max(), append);
+        ASSERT(r.has_value());
+        ASSERT_EQ(text, before + after);
+        ASSERT_EQ(r.value(), text.size());
+        text.clear();
+        r = oak::read_time_range("tests/index_test.log",
+                                 std::chrono::system_clock::time_point::min(),
+                                 middle, append);
+        ASSERT(text.starts_with("before 0\n"));
+        ASSERT(text.ends_with("before 49\n"));
+
+        // Reopened, the index goes on from the end of the file
+        exp = oak::set_file("tests/index_test.log");
+        oak::log_to_file(oak::level::info, "reopened");
+        oak::close_file();
+        index = oak::read_file_index("tests/index_test.log");
+        ASSERT_EQ(index->size(), 11);
+        text.clear();
+        auto last = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(index->back().time_ns + 1)));
+        r = oak::read_time_range("tests/index_test.log", last,
+                                 std::chrono::system_clock::time_point::max(),
+                                 append);
+        ASSERT_EQ(text, "reopened\n");
+    }
+    ASSERT(!oak::read_file_index("tests/no_such_file.log").has_value());
+    oak::set_file_index(0);
+    oak::set_file_format(oak::file_format::text);
+    oak::set_write_mode(oak::write_mode::automatic);
+    std::filesystem::remove("tests/index_test.log");
+    std::filesystem::remove("tests/index_test.log.idx");
+}
+
+void test_search_index()
+{
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    oak::set_write_mode(oak::write_mode::direct);
+    std::filesystem::remove("tests/search_test.log");
+    std::filesystem::remove("tests/search_test.log.bloom");
+    oak::set_search_index(4096);
+    auto exp = oak::set_file("tests/search_test.log");
+    ASSERT(exp.has_value());
+    for (int i = 0; i < 2000; ++i)
+        oak::log_to_file(oak::level::info, "request req-{} done", i);
+
+    std::vector<std::string> found;
+    auto collect = [&found](std::string_view record)
+    { found.emplace_back(record); };
+    // Still in the open segment, read without a filter
+    auto r = oak::search_file("tests/search_test.log", "req-1999", collect);
+    ASSERT(r.has_value());
+    ASSERT_EQ(r->matches, 1);
+    oak::close_file();
+
+    found.clear();
+    r = oak::search_file("tests/search_test.log", "req-1234", collect);
+    ASSERT(r.has_value());
+    ASSERT(r->segments > 5);
+    ASSERT(r->skipped + 2 >= r->segments);
+    ASSERT_EQ(found.size(), 1);
+    ASSERT_EQ(found.front(), "request req-1234 done");
+    // Whole tokens only
+    r = oak::search_file("tests/search_test.log", "req-12", collect);
+    ASSERT_EQ(r->matches, 1);
+    r = oak::search_file("tests/search_test.log", "req-12345", collect);
+    ASSERT_EQ(r->matches, 0);
+    r = oak::search_file("tests/search_test.log", "done req-7", collect);
+    ASSERT_EQ(r->matches, 1);
+    r = oak::search_file("tests/search_test.log", "request", collect);
+    ASSERT_EQ(r->matches, 2000);
+    ASSERT_EQ(r->skipped, 0);
+    ASSERT(!oak::search_file("tests/search_test.log", " ", collect)
+                .has_value());
+
+    // Without the sidecar the whole file is read
+    std::filesystem::remove("tests/search_test.log.bloom");
+    r = oak::search_file("tests/search_test.log", "req-1234", collect);
+    ASSERT_EQ(r->segments, 0);
+    ASSERT_EQ(r->matches, 1);
+    oak::set_search_index(0);
+    oak::set_write_mode(oak::write_mode::automatic);
+    std::filesystem::remove("tests/search_test.log");
+}
+
 void test_log()
 {
     oak::set_level(oak::level::debug);
@@ -124,6 +368,1017 @@ void test_async()
     oak::async(oak::level::info, "This was async!");
 }
 
+void test_lazy()
+{
+    int calls = 0;
+    auto state = oak::lazy(
+        [&calls]
+        {
+            calls++;
+            return 42;
+        });
+
+    oak::set_level(oak::level::error);
+    oak::debug("state {}", state);
+    ASSERT_EQ(calls, 0);
+
+    oak::set_flags(oak::flags::none);
+    auto s = oak::log_to_string(oak::level::debug, "state {:>4} {}", state,
+                                oak::lazy([] { return std::string("ok"); }));
+    ASSERT_EQ(calls, 1);
+    ASSERT_EQ(s, "state   42 ok\n");
+    oak::set_flags(oak::flags::level);
+}
+
+// The fast path of vformat_append against std::vformat
+template <typename... Args>
+bool formats_like_std(std::string_view fmt, Args... args)
+{
+    std::string out = "prefix ";
+    oak::vformat_append(out, fmt, std::make_format_args(args...));
+    return out == "prefix " + std::vformat(fmt, std::make_format_args(args...));
+}
+
+void test_fast_format()
+{
+    ASSERT(formats_like_std("{} {} {} {}", 0, -1, INT_MIN, INT_MAX));
+    ASSERT(formats_like_std("{} {} {}", LLONG_MIN, LLONG_MAX, ULLONG_MAX));
+    ASSERT(formats_like_std("{}{}{}", short(-7), 99u, 100ul));
+    ASSERT(formats_like_std("{} {} {} {}", 0.1, -0.0, 1e300, 5e-324));
+    ASSERT(formats_like_std("{} {} {}", 1.1f, 1.0 / 0.0, -std::nan("")));
+    ASSERT(formats_like_std("{} {} {}", true, 'c', "text"));
+    ASSERT(formats_like_std("{} {}", std::string("str"),
+                            std::string_view("view")));
+    int i = 0;
+    ASSERT(formats_like_std("{} {}", static_cast<void *>(&i),
+                            static_cast<const void *>(nullptr)));
+    ASSERT(formats_like_std("{{}} {{{}}} }}", 42));
+    // Left to std::vformat_to
+    ASSERT(formats_like_std("{:>8} {:x}", 42, 255));
+    ASSERT(formats_like_std("{1} {0}", 1, 2));
+    ASSERT(formats_like_std("{} {}", oak::level::warn, 3));
+    ASSERT_EQ(oak::log_to_string(oak::level::info, "{} {", 42), "");
+    ASSERT_EQ(oak::log_to_string(oak::level::info, "{}"), "");
+
+    std::array<std::byte, 100> bytes;
+    std::string expected;
+    for (std::size_t b = 0; b < bytes.size(); ++b)
+    {
+        bytes[b] = static_cast<std::byte>(b * 37);
+        expected += std::format("{:02x}", (b * 37) & 0xff);
+    }
+    ASSERT_EQ(std::format("{}", oak::hex(bytes)), expected);
+    ASSERT_EQ(std::format("{}", oak::hex(std::span(bytes).first(5))),
+              expected.substr(0, 10));
+    ASSERT_EQ(std::format("[{}]", oak::hex({})), "[]");
+}
+
+void test_stats()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::level);
+    std::this_thread::sleep_for(200ms);
+    oak::reset_stats();
+
+    for (int i = 0; i < 10; ++i)
+        oak::info("stats {}", i);
+    oak::error("stats error");
+    std::this_thread::sleep_for(200ms);
+
+    auto snap = oak::stats();
+    ASSERT_EQ(snap.queue_depth, 0);
+#ifdef OAK_USE_STATS
+    auto info = static_cast<std::size_t>(oak::level::info);
+    auto error = static_cast<std::size_t>(oak::level::error);
+    auto std_out = static_cast<std::size_t>(oak::destination::std_out);
+    ASSERT_EQ(snap.messages[info], 10);
+    ASSERT_EQ(snap.messages[error], 1);
+    ASSERT_EQ(snap.bytes[error], std::string("[ level=error ] stats error\n").size());
+    ASSERT_EQ(snap.enqueue_wait.count, 11);
+    ASSERT_EQ(snap.writer_lag.count, 11);
+    ASSERT_EQ(snap.sinks[std_out].writes, 11);
+    ASSERT_EQ(snap.sinks[std_out].errors, 0);
+    ASSERT(snap.writer_lag.percentile(99) <= snap.writer_lag.max);
+#endif
+
+    // A full queue drops the new messages
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::queued);
+    oak::set_queue_capacity(2);
+    for (int i = 0; i < 5; ++i)
+        oak::info("dropped {}", i);
+    snap = oak::stats();
+    ASSERT_EQ(snap.queue_depth, 2);
+    ASSERT(snap.queue_high_water >= 2);
+#ifdef OAK_USE_STATS
+    ASSERT_EQ(snap.drops, 3);
+#endif
+    oak::set_queue_capacity(0);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::init_writer();
+}
+
+void test_stats_export()
+{
+    using namespace std::chrono_literals;
+    std::filesystem::remove("tests/oak_stats.prom");
+    oak::set_stats_export(50ms, "tests/oak_stats.prom", true);
+    oak::info("export me");
+    std::this_thread::sleep_for(300ms);
+    oak::set_stats_export(0ms);
+
+    ASSERT(std::filesystem::exists("tests/oak_stats.prom"));
+    std::ifstream prom("tests/oak_stats.prom");
+    std::stringstream content;
+    content << prom.rdbuf();
+    ASSERT(content.str().find("oak_messages_total{level=\"info\"}")
+           != std::string::npos);
+    ASSERT(content.str().find("oak_writer_lag_seconds_count")
+           != std::string::npos);
+    ASSERT(content.str().find("oak_messages_per_second") != std::string::npos);
+    std::filesystem::remove("tests/oak_stats.prom");
+
+    // An idle writer exports too
+    oak::set_stats_export(50ms, "tests/oak_stats.prom");
+    std::this_thread::sleep_for(300ms);
+    oak::set_stats_export(0ms);
+    ASSERT(std::filesystem::exists("tests/oak_stats.prom"));
+    std::filesystem::remove("tests/oak_stats.prom");
+}
+
+void test_faulty_sink()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // Partial writes and EAGAIN are retried until the record is complete
+    sink->max_write = 3;
+    sink->eagain_every = 4;
+    std::string expected;
+    for (int i = 0; i < 20; ++i)
+    {
+        oak::info("partial write {}", i);
+        expected += std::format("partial write {}\n", i);
+    }
+    std::this_thread::sleep_for(200ms);
+    ASSERT_EQ(sink->data(), expected);
+
+    // Any other error loses the record for this sink and is counted
+    sink->max_write = 0;
+    sink->eagain_every = 0;
+    sink->error_every = 2;
+    sink->clear();
+    oak::reset_stats();
+    for (int i = 0; i < 10; ++i)
+        oak::info("error {}", i);
+    std::this_thread::sleep_for(200ms);
+    ASSERT(sink->data().size() < expected.size());
+#ifdef OAK_USE_STATS
+    auto custom = static_cast<std::size_t>(oak::destination::custom);
+    ASSERT(oak::stats().sinks[custom].errors > 0);
+#endif
+    sink->error_every = 0;
+    oak::remove_sink(sink);
+}
+
+void test_ring_file()
+{
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    std::filesystem::remove("tests/ring_test.ring");
+    auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+    auto exp = oak::open_ring_file("tests/ring_test.ring", 1);
+    ASSERT(exp.has_value());
+    ASSERT(oak::is_ring_file("tests/ring_test.ring"));
+    ASSERT_EQ(std::filesystem::file_size("tests/ring_test.ring"), 2 * page);
+    ASSERT_EQ(oak::read_ring_file("tests/ring_test.ring").value(), "");
+
+    // Wraps many times, the oldest whole records are kept
+    auto ring = exp.value();
+    oak::add_sink(ring);
+    oak::set_write_mode(oak::write_mode::direct);
+    for (int i = 0; i < 2000; ++i)
+        oak::info("ring {}", i);
+    oak::flush();
+    auto text = oak::read_ring_file("tests/ring_test.ring");
+    ASSERT(text.has_value());
+    ASSERT(text->size() <= page);
+    ASSERT(text->size() > page - 16);
+    ASSERT(text->ends_with("ring 1999\n"));
+    std::istringstream lines(text.value());
+    std::string line;
+    std::getline(lines, line);
+    int next = std::stoi(line.substr(5));
+    ASSERT(next > 1000);
+    while (std::getline(lines, line))
+    {
+        ASSERT_EQ(line, std::format("ring {}", ++next));
+    }
+    ASSERT_EQ(next, 1999);
+    ASSERT_EQ(std::filesystem::file_size("tests/ring_test.ring"), 2 * page);
+
+    // Reopened, the records are kept and appended to
+    oak::remove_sink(ring);
+    ring.reset();
+    exp = oak::open_ring_file("tests/ring_test.ring", 2 * page);
+    ASSERT(exp.has_value());
+    oak::add_sink(exp.value());
+    oak::info("after reopen");
+    text = oak::read_ring_file("tests/ring_test.ring");
+    ASSERT(text->ends_with("ring 1999\nafter reopen\n"));
+    oak::remove_sink(exp.value());
+    oak::set_write_mode(oak::write_mode::automatic);
+
+    // Other files are left alone
+    std::ofstream("tests/ring_test.txt") << "plain\n";
+    ASSERT(!oak::is_ring_file("tests/ring_test.txt"));
+    ASSERT(!oak::open_ring_file("tests/ring_test.txt", page).has_value());
+    ASSERT(!oak::read_ring_file("tests/ring_test.txt").has_value());
+    std::filesystem::remove("tests/ring_test.txt");
+    std::filesystem::remove("tests/ring_test.ring");
+}
+
+void test_fork()
+{
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    std::filesystem::remove("tests/fork_test.txt");
+    auto exp = oak::set_file("tests/fork_test.txt");
+    ASSERT(exp.has_value());
+    oak::set_per_process_files(true);
+    oak::info("before fork");
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // A writer runs in the child and writes to its own file, and
+        // the queue is drained at exit
+        auto own = std::format("tests/fork_test.txt.{}", getpid());
+        if (oak::logger::log_file_path != own)
+            std::exit(1);
+        oak::info("from the child");
+        oak::flush();
+        std::ifstream file(own);
+        std::string line;
+        std::getline(file, line);
+        std::exit(line == "from the child" ? 0 : 2);
+    }
+    ASSERT(pid > 0);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    oak::info("parent after fork");
+    ASSERT(wait_until([] { return oak::queue_size() == 0; }));
+    oak::flush();
+
+    auto child_file = std::format("tests/fork_test.txt.{}", pid);
+    std::ifstream child(child_file);
+    std::stringstream child_content;
+    child_content << child.rdbuf();
+    ASSERT_EQ(child_content.str(), "from the child\n");
+
+    std::ifstream parent("tests/fork_test.txt");
+    std::stringstream parent_content;
+    parent_content << parent.rdbuf();
+    ASSERT_EQ(parent_content.str(), "before fork\nparent after fork\n");
+
+    oak::set_per_process_files(false);
+    oak::close_file();
+    std::filesystem::remove("tests/fork_test.txt");
+    std::filesystem::remove(child_file);
+}
+
+void test_shutdown()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // Everything queued is written before the writer stops
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::queued);
+    for (int i = 0; i < 100; ++i)
+        oak::info("drain {}", i);
+    oak::init_writer();
+    auto report = oak::stop_writer();
+    ASSERT_EQ(report.discarded, 0);
+    ASSERT(!report.deadline_expired);
+    auto written = sink->data();
+    ASSERT_EQ(std::count(written.begin(), written.end(), '\n'), 100);
+
+    // A slow sink is abandoned at the deadline, the rest is discarded
+    sink->delay_us = 2000;
+    for (int i = 0; i < 200; ++i)
+        oak::info("slow {}", i);
+    oak::set_shutdown_deadline(50ms);
+    oak::init_writer();
+    auto start = std::chrono::steady_clock::now();
+    report = oak::stop_writer();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    ASSERT(report.deadline_expired);
+    ASSERT(report.discarded > 0);
+    ASSERT(report.drained + report.discarded <= 200);
+    ASSERT(elapsed < 1s);
+    ASSERT_EQ(oak::queue_size(), 0);
+
+    // A writer blocked in a sink is abandoned, its records are discarded
+    sink->delay_us = 0;
+    sink->stall();
+    oak::init_writer();
+    for (int i = 0; i < 10; ++i)
+        oak::info("stuck {}", i);
+    ASSERT(wait_until([&] { return sink->stalled_writes() > 0; }));
+    start = std::chrono::steady_clock::now();
+    report = oak::stop_writer();
+    elapsed = std::chrono::steady_clock::now() - start;
+    ASSERT(report.deadline_expired);
+    ASSERT_EQ(report.drained, 0);
+    ASSERT_EQ(report.discarded, 10);
+    ASSERT(elapsed < 5s);
+    ASSERT_EQ(oak::queue_size(), 0);
+    sink->release();
+
+    // And the process still exits, with the writer blocked at exit
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Leaked: the abandoned writer blocks in it past the destructors
+        auto *stuck = new std::shared_ptr<faulty_sink>(
+            std::make_shared<faulty_sink>());
+        oak::add_sink(*stuck);
+        (*stuck)->stall();
+        oak::init_writer();
+        oak::info("stuck at exit");
+        if (!wait_until([&] { return (*stuck)->stalled_writes() > 0; }))
+            std::exit(2);
+        std::exit(0);
+    }
+    ASSERT(pid > 0);
+    int status = -1;
+    bool exited = wait_until([&]
+                             { return waitpid(pid, &status, WNOHANG) == pid; });
+    if (!exited)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+    }
+    ASSERT(exited);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    oak::set_shutdown_deadline(5000ms);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::remove_sink(sink);
+    oak::init_writer();
+}
+
+void test_direct_write()
+{
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    oak::stop_writer();
+    std::filesystem::remove("tests/direct_test.txt");
+    auto exp = oak::set_file("tests/direct_test.txt");
+    ASSERT(exp.has_value());
+
+    // Without a writer the records are written by the callers, whole
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back(
+            [t]
+            {
+                for (int i = 0; i < 100; ++i)
+                    oak::info("thread {} record {} {}", t, i,
+                              std::string(64, 'x'));
+            });
+    for (auto &t : threads)
+        t.join();
+    ASSERT_EQ(oak::queue_size(), 0);
+
+    std::ifstream file("tests/direct_test.txt");
+    std::string line;
+    int lines = 0;
+    bool whole = true;
+    while (std::getline(file, line))
+    {
+        lines++;
+        whole = whole && line.starts_with("thread ")
+                && line.ends_with(std::string(64, 'x'));
+    }
+    ASSERT_EQ(lines, 400);
+    ASSERT(whole);
+
+    // The string overloads are written by the callers as well
+    oak::log_to_file(std::string("raw file\n"));
+    ASSERT_EQ(oak::queue_size(), 0);
+    std::ifstream raw_file("tests/direct_test.txt");
+    std::stringstream raw_content;
+    raw_content << raw_file.rdbuf();
+    ASSERT(raw_content.str().ends_with("raw file\n"));
+
+    std::stringstream out;
+    auto *cout_buf = std::cout.rdbuf(out.rdbuf());
+    oak::log_to_stdout(std::string("raw stdout\n"));
+    std::cout.rdbuf(cout_buf);
+    ASSERT_EQ(oak::queue_size(), 0);
+    ASSERT_EQ(out.str(), "raw stdout\n");
+
+#ifdef OAK_USE_SOCKETS
+    int pair[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    oak::logger::log_socket = pair[0];
+    oak::log_to_socket(std::string("raw socket\n"));
+    oak::logger::log_socket = -1;
+    ASSERT_EQ(oak::queue_size(), 0);
+    char buf[64];
+    ssize_t n = read(pair[1], buf, sizeof(buf));
+    ASSERT_EQ(std::string(buf, n > 0 ? static_cast<std::size_t>(n) : 0),
+              "raw socket\n");
+    close(pair[0]);
+    close(pair[1]);
+#endif
+
+    oak::close_file();
+    std::filesystem::remove("tests/direct_test.txt");
+    oak::init_writer();
+}
+
+void test_hybrid_write()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+    std::this_thread::sleep_for(100ms);
+
+    // Idle: the caller writes the record itself
+    oak::set_write_mode(oak::write_mode::hybrid);
+    oak::reset_stats();
+    oak::info("idle");
+    ASSERT_EQ(sink->data(), "idle\n");
+#ifdef OAK_USE_STATS
+    ASSERT_EQ(oak::stats().direct_writes, 1);
+#endif
+
+    // Busy writer: the records are queued, and the order is kept when
+    // the caller takes over again
+    sink->clear();
+    sink->stall();
+    oak::set_write_mode(oak::write_mode::queued);
+    oak::info("record {}", 0);
+    while (sink->stalled_writes() == 0)
+        std::this_thread::sleep_for(1ms);
+    oak::set_write_mode(oak::write_mode::hybrid);
+    std::string expected = "record 0\n";
+    for (int i = 1; i < 10; ++i)
+    {
+        oak::info("record {}", i);
+        expected += std::format("record {}\n", i);
+    }
+    sink->release();
+    for (int i = 10; i < 100; ++i)
+    {
+        oak::info("record {}", i);
+        expected += std::format("record {}\n", i);
+    }
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    ASSERT_EQ(sink->data(), expected);
+
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::remove_sink(sink);
+}
+
+void test_priority_lane()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::seq);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // The error is written before the backlog of debug records
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::queued);
+    oak::set_ordering(oak::ordering::priority, true);
+    for (int i = 0; i < 1000; ++i)
+        oak::debug("backlog {}", i);
+    oak::error("failure");
+    oak::init_writer();
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    auto data = sink->data();
+    auto first = data.substr(0, data.find('\n'));
+    ASSERT(first.ends_with("] failure"));
+
+    // The sequence numbers restore the call order
+    auto seq_of = [](const std::string &line)
+    { return std::stoull(line.substr(line.find("seq=") + 4)); };
+    std::istringstream lines(data);
+    std::string line;
+    std::uint64_t failure_seq = 0, last_backlog_seq = 0;
+    while (std::getline(lines, line))
+    {
+        if (line.ends_with("failure"))
+            failure_seq = seq_of(line);
+        else
+            last_backlog_seq = seq_of(line);
+    }
+    ASSERT(failure_seq > last_backlog_seq);
+
+    // An error waits for one record of a batch being written at most
+    sink->clear();
+    sink->stall();
+    for (int i = 0; i < 100; ++i)
+        oak::debug("backlog {}", i);
+    while (sink->stalled_writes() == 0)
+        std::this_thread::sleep_for(1ms);
+    oak::error("failure");
+    sink->release();
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    data = sink->data();
+    ASSERT(data.find("failure") < data.find("backlog 5\n"));
+
+    oak::set_ordering(oak::ordering::strict);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::set_flags(oak::flags::level);
+    oak::remove_sink(sink);
+}
+
+void test_backlog()
+{
+    using namespace std::chrono_literals;
+    oak::set_flags(oak::flags::level);
+    oak::set_level(oak::level::warn);
+    oak::set_write_mode(oak::write_mode::direct);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // Filtered out records are kept, the last 4 of them
+    oak::set_backlog(oak::level::debug, 4);
+    for (int i = 0; i < 10; ++i)
+    {
+        char name[8];
+        std::snprintf(name, sizeof(name), "n%d", i);
+        std::string value = std::format("v{}", i);
+        oak::debug("context {} {} {}", i, name, value);
+        // The arguments are copies, not references to the caller
+        name[1] = 'X';
+        value = "gone";
+    }
+    ASSERT_EQ(sink->data(), "");
+
+    // An error writes them first
+    oak::error("failure");
+    ASSERT_EQ(sink->data(), "[ level=debug ] context 6 n6 v6\n"
+                            "[ level=debug ] context 7 n7 v7\n"
+                            "[ level=debug ] context 8 n8 v8\n"
+                            "[ level=debug ] context 9 n9 v9\n"
+                            "[ level=error ] failure\n");
+
+    // Arguments too large to keep are formatted at once
+    sink->clear();
+    std::string big(64, 'b');
+    oak::info("{} {} {} {} {}", big, big, big, big, big);
+    oak::dump_backlog();
+    ASSERT_EQ(sink->data(), std::format("[ level=info ] {} {} {} {} {}\n",
+                                        big, big, big, big, big));
+    sink->clear();
+    oak::dump_backlog();
+    ASSERT_EQ(sink->data(), "");
+
+    // One that fails to format is not kept, nor is a blank record
+    oak::debug("kept {}", 1);
+    oak::info("{} {} {} {} {} {}", big, big, big, big, big);
+    oak::dump_backlog();
+    ASSERT_EQ(sink->data(), "[ level=debug ] kept 1\n");
+    sink->clear();
+
+    // A lazy argument is not computed for the backlog, nor kept
+    int calls = 0;
+    auto state = oak::lazy(
+        [&calls]
+        {
+            calls++;
+            return 42;
+        });
+    for (int i = 0; i < 10; ++i)
+        oak::debug("lazy {} {}", i, state);
+    ASSERT_EQ(calls, 0);
+    oak::dump_backlog();
+    ASSERT_EQ(calls, 0);
+    ASSERT_EQ(sink->data(), "");
+    oak::error("lazy {}", state);
+    ASSERT_EQ(calls, 1);
+    ASSERT_EQ(sink->data(), "[ level=error ] lazy 42\n");
+    sink->clear();
+
+    oak::set_backlog(oak::level::disabled, 0);
+    oak::debug("not kept");
+    oak::error("failure");
+    ASSERT_EQ(sink->data(), "[ level=error ] failure\n");
+
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::remove_sink(sink);
+}
+
+void test_overload()
+{
+    using namespace std::chrono_literals;
+    oak::set_flags(oak::flags::level);
+    oak::set_level(oak::level::debug);
+    oak::set_write_mode(oak::write_mode::queued);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+    oak::set_overload(8, 2);
+
+    // The writer stalls on the first record while the queue grows
+    sink->stall();
+    oak::debug("first");
+    while (sink->stalled_writes() == 0)
+        std::this_thread::sleep_for(1ms);
+    for (int i = 0; i < 7; ++i)
+        oak::debug("kept {}", i);
+    ASSERT_EQ(oak::get_level(), oak::level::info);
+    for (int i = 0; i < 20; ++i)
+        oak::debug("shed {}", i);
+    for (int i = 0; i < 7; ++i)
+        oak::info("kept {}", i);
+    ASSERT_EQ(oak::get_level(), oak::level::warn);
+    oak::error("still written");
+
+    // Restored once the writer has drained the queue
+    sink->release();
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    ASSERT_EQ(oak::get_level(), oak::level::debug);
+    auto data = sink->data();
+    ASSERT(data.find("shed") == std::string::npos);
+    ASSERT(data.find("still written") != std::string::npos);
+    ASSERT(data.find("oak overload raised: queue_depth=8 ") !=
+           std::string::npos);
+    ASSERT(data.find("level=warn") != std::string::npos);
+    ASSERT(data.find("oak overload cleared: ") != std::string::npos);
+
+    // Sampling keeps the level, and about 1 in 2^30 records below warn
+    sink->clear();
+    oak::set_overload(8, 2, oak::overload_action::sample, 1u << 30);
+    sink->stall();
+    oak::debug("first");
+    while (sink->stalled_writes() == 0)
+        std::this_thread::sleep_for(1ms);
+    for (int i = 0; i < 8; ++i)
+        oak::debug("kept {}", i);
+    ASSERT_EQ(oak::get_level(), oak::level::debug);
+    for (int i = 0; i < 20; ++i)
+        oak::info("shed {}", i);
+    oak::warn("still written");
+    sink->release();
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    data = sink->data();
+    ASSERT(data.find("shed") == std::string::npos);
+    ASSERT(data.find("still written") != std::string::npos);
+    ASSERT(data.find("sampling=1/1073741824") != std::string::npos);
+
+    oak::set_overload(0, 0);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::remove_sink(sink);
+}
+
+void test_fair_ordering()
+{
+    using namespace std::chrono_literals;
+    oak::set_flags(oak::flags::level);
+    oak::set_level(oak::level::debug);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // A thread logging in a loop does not delay the other threads
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::queued);
+    oak::set_ordering(oak::ordering::fair);
+    std::thread flood(
+        []
+        {
+            for (int i = 0; i < 5000; ++i)
+                oak::debug("flood {}", i);
+        });
+    flood.join();
+    std::thread quiet(
+        []
+        {
+            for (int i = 0; i < 10; ++i)
+                oak::debug("quiet {}", i);
+        });
+    quiet.join();
+    ASSERT_EQ(oak::queue_size(), 5010);
+    oak::init_writer();
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    auto data = sink->data();
+    ASSERT(data.find("quiet 9\n") < data.find("flood 1000\n"));
+    ASSERT(data.find("flood 4999\n") != std::string::npos);
+    // The queues of the threads are gone once drained
+    ASSERT_EQ(oak::logger::producers.size(), 0);
+
+    // The records over the quota are dropped, the writer says how many
+    sink->clear();
+    oak::stop_writer();
+    oak::set_producer_quota(1000);
+    std::thread limited(
+        []
+        {
+            for (int i = 0; i < 100; ++i)
+                oak::debug("limited {}", i);
+        });
+    limited.join();
+    oak::init_writer();
+    while (oak::queue_size() > 0)
+        std::this_thread::sleep_for(1ms);
+    data = sink->data();
+    std::size_t kept = 0;
+    for (auto pos = data.find("limited"); pos != std::string::npos;
+         pos = data.find("limited", pos + 1))
+        kept++;
+    ASSERT(kept > 0 && kept < 100);
+    ASSERT(data.find("oak throttled: tid=") !=
+           std::string::npos);
+    ASSERT(data.find(std::format("dropped={} ", 100 - kept)) !=
+           std::string::npos);
+
+    oak::set_producer_quota(0);
+    oak::set_ordering(oak::ordering::strict);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::remove_sink(sink);
+}
+
+void test_per_cpu_ordering()
+{
+    oak::set_flags(oak::flags::none);
+    oak::set_level(oak::level::debug);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // Queued on several CPUs, the records of a thread stay in order
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::queued);
+    oak::set_ordering(oak::ordering::per_cpu);
+    auto produce = []
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back(
+                [t]
+                {
+                    for (int i = 0; i < 1000; ++i)
+                        oak::debug("cpu {} {}", t, i);
+                });
+        for (auto &t : threads)
+            t.join();
+    };
+    produce();
+    ASSERT_EQ(oak::queue_size(), 4000);
+    oak::init_writer();
+    ASSERT(sink->wait_lines(4000));
+    std::istringstream lines(sink->data());
+    std::string line;
+    std::array<int, 4> next = {};
+    bool ordered = true;
+    while (std::getline(lines, line))
+    {
+        int t = 0, i = 0;
+        std::sscanf(line.c_str(), "cpu %d %d", &t, &i);
+        ordered = ordered && i == next[static_cast<std::size_t>(t)]++;
+    }
+    ASSERT(ordered);
+    ASSERT((next == std::array<int, 4>{1000, 1000, 1000, 1000}));
+
+    // Producers wake the writer without taking its lock first
+    sink->clear();
+    bool delivered = true;
+    for (int round = 0; round < 20 && delivered; ++round)
+    {
+        produce();
+        delivered =
+            sink->wait_lines(static_cast<std::size_t>(round + 1) * 4000);
+    }
+    ASSERT(delivered);
+    ASSERT_EQ(std::ranges::count(sink->data(), '\n'), 80000);
+
+    oak::set_ordering(oak::ordering::strict);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::set_flags(oak::flags::level);
+    oak::remove_sink(sink);
+}
+
+void test_per_cpu_wakeup()
+{
+    oak::set_flags(oak::flags::none);
+    oak::set_level(oak::level::debug);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+    oak::set_write_mode(oak::write_mode::queued);
+    oak::set_ordering(oak::ordering::per_cpu);
+
+    // Every record races with the writer going back to sleep after the
+    // previous one: a lost wakeup leaves it queued for good
+    bool delivered = true;
+    for (std::size_t i = 0; i < 20000 && delivered; ++i)
+    {
+        oak::debug("wake {}", i);
+        delivered = sink->wait_lines(i + 1, std::chrono::seconds(2));
+    }
+    ASSERT(delivered);
+
+    oak::set_ordering(oak::ordering::strict);
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::set_flags(oak::flags::level);
+    oak::remove_sink(sink);
+}
+
+void test_node_writers()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    ASSERT(oak::numa_nodes() >= 1);
+
+    auto remove_files = [](const std::string &path)
+    {
+        std::filesystem::remove(path);
+        for (int node = 0; node < oak::numa_nodes(); ++node)
+            for (auto *ext : {"", ".idx"})
+                std::filesystem::remove(
+                    std::format("{}.node{}{}", path, node, ext));
+    };
+
+    // Every node writes the records of its CPUs to its own file, indexed
+    // as the log file
+    oak::stop_writer();
+    remove_files("tests/node_test.txt");
+    remove_files("tests/node_test2.txt");
+    oak::set_file_index(1);
+    auto exp = oak::set_file("tests/node_test.txt");
+    ASSERT(exp.has_value());
+    oak::set_ordering(oak::ordering::per_cpu);
+    oak::set_node_writers(true);
+    oak::set_writer_node(0);
+    oak::init_writer();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back(
+            [t]
+            {
+                for (int i = 0; i < 500; ++i)
+                    oak::info("node {} {}", t, i);
+            });
+    for (auto &t : threads)
+        t.join();
+    ASSERT(wait_until([] { return oak::queue_size() == 0; }));
+
+    std::array<int, 4> next = {};
+    bool ordered = true;
+    std::size_t entries = 0;
+    for (int node = 0; node < oak::numa_nodes(); ++node)
+    {
+        auto path = std::format("tests/node_test.txt.node{}", node);
+        auto index = oak::read_file_index(path);
+        if (index.has_value())
+            entries += index->size();
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            int t = 0, i = 0;
+            std::sscanf(line.c_str(), "node %d %d", &t, &i);
+            ordered = ordered && i == next[static_cast<std::size_t>(t)]++;
+        }
+    }
+    ASSERT(ordered);
+    ASSERT((next == std::array<int, 4>{500, 500, 500, 500}));
+    ASSERT_EQ(std::filesystem::file_size("tests/node_test.txt"), 0);
+    ASSERT_EQ(entries, 2000);
+
+    // A new log file moves the node writers to it
+    exp = oak::set_file("tests/node_test2.txt");
+    ASSERT(exp.has_value());
+    oak::info("moved");
+    ASSERT(wait_until([] { return oak::queue_size() == 0; }));
+    std::uintmax_t moved = 0;
+    for (int node = 0; node < oak::numa_nodes(); ++node)
+    {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(
+            std::format("tests/node_test2.txt.node{}", node), ec);
+        moved += ec ? 0 : size;
+    }
+    ASSERT_EQ(moved, std::string_view("moved\n").size());
+
+    // Every record races with a node writer going back to sleep: a lost
+    // wakeup leaves it queued for good
+    bool delivered = true;
+    for (int i = 0; i < 5000 && delivered; ++i)
+    {
+        oak::info("wake {}", i);
+        delivered = wait_until([] { return oak::queue_size() == 0; }, 2s);
+    }
+    ASSERT(delivered);
+
+    oak::stop_writer();
+    oak::set_node_writers(false);
+    oak::set_writer_node(-1);
+    oak::set_ordering(oak::ordering::strict);
+    oak::set_file_index(0);
+    oak::close_file();
+    remove_files("tests/node_test.txt");
+    remove_files("tests/node_test2.txt");
+    std::filesystem::remove("tests/node_test.txt.idx");
+    std::filesystem::remove("tests/node_test2.txt.idx");
+    oak::init_writer();
+}
+
+void test_warmup()
+{
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    std::filesystem::remove("tests/warmup_test.txt");
+    auto exp = oak::set_file("tests/warmup_test.txt");
+    ASSERT(exp.has_value());
+
+    // Without a writer every record stays in the warmed queue
+    oak::stop_writer();
+    oak::set_write_mode(oak::write_mode::queued);
+    auto warm = oak::warmup({.records = 16384, .record_size = 512});
+    ASSERT(warm.has_value());
+    std::string text(400, 'x');
+    oak::log_to_file(oak::level::info, "first {}", text);
+    struct rusage before, after;
+    getrusage(RUSAGE_THREAD, &before);
+    for (int i = 0; i < 16000; ++i)
+        oak::log_to_file(oak::level::info, "warm {} {}", i, text);
+    getrusage(RUSAGE_THREAD, &after);
+    ASSERT_EQ(after.ru_minflt - before.ru_minflt, 0);
+    ASSERT_EQ(oak::queue_size(), 16001);
+
+    oak::init_writer();
+    oak::stop_writer();
+    std::ifstream file("tests/warmup_test.txt");
+    std::string line, last;
+    int lines = 0;
+    for (; std::getline(file, line); lines++)
+        last = line;
+    ASSERT_EQ(lines, 16001);
+    ASSERT(last.starts_with("warm 15999 x"));
+    oak::set_write_mode(oak::write_mode::automatic);
+    oak::close_file();
+    std::filesystem::remove("tests/warmup_test.txt");
+    oak::init_writer();
+}
+
+void test_stalled_sink()
+{
+    using namespace std::chrono_literals;
+    oak::set_level(oak::level::debug);
+    oak::set_flags(oak::flags::none);
+    auto sink = std::make_shared<faulty_sink>();
+    oak::add_sink(sink);
+
+    // The writer blocks in the sink, producers must not wait for it:
+    // every call returns before the sink is released
+    sink->stall();
+    oak::info("stall the writer");
+    ASSERT(wait_until([&] { return sink->stalled_writes() > 0; }));
+    std::atomic<int> calls = 0;
+    std::thread producer(
+        [&calls]
+        {
+            for (int i = 0; i < 200; ++i)
+            {
+                oak::info("stalled {}", i);
+                calls++;
+            }
+        });
+    bool returned = wait_until([&calls] { return calls.load() == 200; });
+    auto backlog = oak::queue_size();
+    sink->release();
+    producer.join();
+
+    ASSERT(returned);
+    ASSERT(backlog >= 200);
+    ASSERT(sink->wait_lines(201));
+    ASSERT(wait_until([] { return oak::queue_size() == 0; }));
+    oak::remove_sink(sink);
+}
+
 #ifdef OAK_USE_SOCKETS
 void test_unix_socket_connect_and_send_message()
 {
@@ -235,9 +1490,32 @@ int main()
     test_flags();
     test_settings_file();
     test_file();
+    test_framed_file();
+    test_file_index();
+    test_search_index();
     test_log();
     test_macros();
     test_async();
+    test_lazy();
+    test_fast_format();
+    test_stats();
+    test_stats_export();
+    test_zero_allocations();
+    test_faulty_sink();
+    test_stalled_sink();
+    test_ring_file();
+    test_fork();
+    test_shutdown();
+    test_direct_write();
+    test_hybrid_write();
+    test_priority_lane();
+    test_backlog();
+    test_overload();
+    test_fair_ordering();
+    test_per_cpu_ordering();
+    test_per_cpu_wakeup();
+    test_node_writers();
+    test_warmup();
 #ifdef OAK_USE_SOCKETS
 #ifdef __unix__
     test_unix_socket();
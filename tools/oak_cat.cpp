@@ -0,0 +1,168 @@
+/*
+ * oak-cat: prints oak log files in chronological order
+ *
+ * Usage:
+ *     oak-cat [--from <time>] [--to <time>] <file>...
+ *     oak-cat --grep <terms> <file>...
+ *
+ * Ring files, see oak::open_ring_file(), are printed from their oldest
+ * record. Framed files, see oak::set_file_format(), are printed without
+ * their frames, the corrupted bytes are skipped and reported. Any other
+ * file is printed as it is.
+ *
+ * With --from or --to only the records written in that range are
+ * printed, found with the index of the file, see oak::set_file_index().
+ * A time is `YYYY-MM-DD HH:MM[:SS]`, or `HH:MM[:SS]` for today, in local
+ * time.
+ *
+ * With --grep only the records holding every token of the terms are
+ * printed, reading just the segments whose bloom filter may hold them,
+ * see oak::set_search_index().
+ */
+
+#include "oak/oak.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using clock_type = std::chrono::system_clock;
+
+static std::optional<clock_type::time_point> parse_time(const std::string &text)
+{
+    std::time_t now = std::time(nullptr);
+    std::tm today = {};
+    localtime_r(&now, &today);
+    for (const char *format :
+         {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+          "%Y-%m-%dT%H:%M", "%H:%M:%S", "%H:%M"})
+    {
+        std::tm tm = today;
+        tm.tm_sec = 0;
+        std::istringstream in(text);
+        in >> std::get_time(&tm, format);
+        if (in.fail() || in.peek() != std::char_traits<char>::eof())
+            continue;
+        tm.tm_isdst = -1;
+        return clock_type::from_time_t(std::mktime(&tm));
+    }
+    return std::nullopt;
+}
+
+static bool print_file(const std::string &path)
+{
+    if (oak::is_ring_file(path))
+    {
+        auto records = oak::read_ring_file(path);
+        if (!records.has_value())
+        {
+            std::fprintf(stderr, "%s: %s\n", path.c_str(),
+                         records.error().c_str());
+            return false;
+        }
+        std::cout << records.value();
+        return true;
+    }
+
+    if (oak::is_framed_file(path))
+    {
+        auto contents = oak::read_framed_file(path);
+        if (!contents.has_value())
+        {
+            std::fprintf(stderr, "%s: %s\n", path.c_str(),
+                         contents.error().c_str());
+            return false;
+        }
+        std::cout << contents->records;
+        if (contents->corrupted > 0)
+            std::fprintf(stderr, "%s: skipped %llu corrupted bytes\n",
+                         path.c_str(),
+                         static_cast<unsigned long long>(contents->corrupted));
+        return true;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        std::fprintf(stderr, "%s: Could not open file\n", path.c_str());
+        return false;
+    }
+    std::cout << file.rdbuf();
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    std::optional<clock_type::time_point> from, to;
+    std::optional<std::string> grep;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if ((arg == "--from" || arg == "--to") && i + 1 < argc)
+        {
+            auto time = parse_time(argv[++i]);
+            if (!time.has_value())
+            {
+                std::fprintf(stderr, "invalid time: %s\n", argv[i]);
+                return 1;
+            }
+            (arg == "--from" ? from : to) = time;
+        }
+        else if (arg == "--grep" && i + 1 < argc)
+            grep = argv[++i];
+        else
+            paths.push_back(arg);
+    }
+    if (paths.empty())
+    {
+        std::fprintf(stderr,
+                     "usage: %s [--from <time>] [--to <time>] <file>...\n"
+                     "       %s --grep <terms> <file>...\n",
+                     argv[0], argv[0]);
+        return 1;
+    }
+
+    int status = 0;
+    for (auto &path : paths)
+    {
+        if (grep.has_value())
+        {
+            auto r = oak::search_file(path, grep.value(),
+                                      [](std::string_view record)
+                                      { std::cout << record << '\n'; });
+            if (!r.has_value())
+            {
+                std::fprintf(stderr, "%s: %s\n", path.c_str(),
+                             r.error().c_str());
+                status = 1;
+            }
+            continue;
+        }
+        if (!from.has_value() && !to.has_value())
+        {
+            if (!print_file(path))
+                status = 1;
+            continue;
+        }
+        auto r = oak::read_time_range(
+            path, from.value_or(clock_type::time_point::min()),
+            to.value_or(clock_type::time_point::max()),
+            [](std::string_view records) { std::cout << records; });
+        if (!r.has_value())
+        {
+            std::fprintf(stderr, "%s: %s\n", path.c_str(),
+                         r.error().c_str());
+            status = 1;
+        }
+    }
+    std::cout << std::flush;
+    return status;
+}
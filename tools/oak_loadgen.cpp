@@ -0,0 +1,571 @@
+/*
+ * oak-loadgen: drives the public oak api with a realistic workload
+ *
+ * Usage:
+ *     oak-loadgen <workload.oak>
+ *     oak-loadgen --replay <log file> [speed] [workload.oak]
+ *
+ * The workload file uses the same `key = value` format of the settings
+ * file, see tools/workload.oak for every supported key. In replay mode the
+ * log file (text or json) is logged again at its recorded timing, one
+ * producer thread for each recorded tid.
+ */
+
+#include "bench.hpp"
+#include "oak/oak.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace oak_bench;
+
+enum class size_distribution
+{
+    fixed = 0,
+    uniform,
+    exponential
+};
+
+struct workload
+{
+    std::size_t threads = 1;
+    double duration = 5;        // seconds
+    double rate = 10000;        // messages per second per thread, 0 = max
+    std::size_t burst = 1;      // messages sent back to back
+    size_distribution sizes = size_distribution::uniform;
+    std::size_t size_min = 16;
+    std::size_t size_max = 256;
+    double size_mean = 64;
+    std::vector<std::pair<oak::level, double>> levels = {
+        {oak::level::info, 1}};
+    std::string file;
+    std::string settings;
+    bool to_stdout = false;
+    std::uint64_t seed = 1;
+};
+
+struct replay_record
+{
+    oak::level lvl;
+    double at;                  // seconds from the first record
+    std::string message;
+};
+
+static std::string strip(std::string s)
+{
+    s.erase(std::remove_if(s.begin(), s.end(), isspace), s.end());
+    return s;
+}
+
+static std::expected<oak::level, std::string> parse_level(
+    const std::string &value)
+{
+    if (value == "debug")
+        return oak::level::debug;
+    if (value == "info")
+        return oak::level::info;
+    if (value == "warn")
+        return oak::level::warn;
+    if (value == "error")
+        return oak::level::error;
+    if (value == "output")
+        return oak::level::output;
+    return std::unexpected("Invalid level " + value);
+}
+
+static std::expected<workload, std::string> parse_workload(
+    const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
+        return std::unexpected("Could not open workload file " + path);
+
+    workload w;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        if (strip(line).empty())
+            continue;
+        std::string key = strip(line.substr(0, line.find('=')));
+        std::string value = strip(line.substr(line.find('=') + 1));
+
+        try
+        {
+            if (key == "threads")
+                w.threads = std::stoul(value);
+            else if (key == "duration")
+                w.duration = std::stod(value);
+            else if (key == "rate")
+                w.rate = std::stod(value);
+            else if (key == "burst")
+                w.burst = std::max<std::size_t>(std::stoul(value), 1);
+            else if (key == "size_min")
+                w.size_min = std::stoul(value);
+            else if (key == "size_max")
+                w.size_max = std::stoul(value);
+            else if (key == "size_mean")
+                w.size_mean = std::stod(value);
+            else if (key == "seed")
+                w.seed = std::stoull(value);
+            else if (key == "file")
+                w.file = value;
+            else if (key == "settings")
+                w.settings = value;
+            else if (key == "stdout")
+                w.to_stdout = value == "on";
+            else if (key == "size")
+            {
+                if (value == "fixed")
+                    w.sizes = size_distribution::fixed;
+                else if (value == "uniform")
+                    w.sizes = size_distribution::uniform;
+                else if (value == "exponential")
+                    w.sizes = size_distribution::exponential;
+                else
+                    return std::unexpected("Invalid size distribution");
+            }
+            else if (key == "levels")
+            {
+                // debug:70,info:20,...
+                w.levels.clear();
+                value += ",";
+                while (value.find(',') != std::string::npos)
+                {
+                    std::string item = value.substr(0, value.find(','));
+                    value = value.substr(value.find(',') + 1);
+                    if (item.empty())
+                        continue;
+                    auto lvl = parse_level(item.substr(0, item.find(':')));
+                    if (!lvl.has_value())
+                        return std::unexpected(lvl.error());
+                    double weight = item.find(':') == std::string::npos
+                                        ? 1
+                                        : std::stod(item.substr(
+                                              item.find(':') + 1));
+                    w.levels.push_back({lvl.value(), weight});
+                }
+            }
+            else
+                return std::unexpected("Invalid key in workload: " + key);
+        }
+        catch (const std::exception &e)
+        {
+            return std::unexpected("Invalid value for " + key);
+        }
+    }
+    if (w.threads == 0 || w.levels.empty() || w.size_max < w.size_min)
+        return std::unexpected("Invalid workload");
+    return w;
+}
+
+static std::string remove_escapes(const std::string &line)
+{
+    std::string out;
+    for (std::size_t i = 0; i < line.size(); ++i)
+    {
+        if (line[i] == '\x1B')
+        {
+            while (i < line.size() && line[i] != 'm')
+                ++i;
+            continue;
+        }
+        out += line[i];
+    }
+    return out;
+}
+
+// Returns the value of `key` in a text prefix or json object
+static std::string field(const std::string &line, const std::string &key,
+                         bool json)
+{
+    std::string pattern = json ? "\"" + key + "\": " : key + "=";
+    auto pos = line.find(pattern);
+    if (pos == std::string::npos)
+        return "";
+    pos += pattern.size();
+    if (json && pos < line.size() && line[pos] == '"')
+    {
+        auto end = line.find('"', pos + 1);
+        return line.substr(pos + 1, end - pos - 1);
+    }
+    auto end = line.find_first_of(json ? ", }" : " ]", pos);
+    return line.substr(pos, end - pos);
+}
+
+static std::expected<std::map<std::string, std::vector<replay_record>>,
+                     std::string>
+parse_log(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
+        return std::unexpected("Could not open log file " + path);
+
+    std::map<std::string, std::vector<replay_record>> by_tid;
+    std::string raw;
+    double first = -1, last = 0, day = 0;
+    while (std::getline(in, raw))
+    {
+        std::string line = remove_escapes(raw);
+        if (line.empty())
+            continue;
+        bool json = line.starts_with("{");
+
+        replay_record rec = {oak::level::info, 0, ""};
+        auto lvl = parse_level(field(line, "level", json));
+        if (lvl.has_value())
+            rec.lvl = lvl.value();
+
+        if (json)
+        {
+            auto pos = line.find("\"message\": \"");
+            auto end = line.rfind("\" }");
+            if (pos != std::string::npos && end != std::string::npos)
+                rec.message = line.substr(pos + 12, end - pos - 12);
+        }
+        else if (line.starts_with("[ ") && line.find(" ] ") != std::string::npos)
+            rec.message = line.substr(line.find(" ] ") + 3);
+        else
+            rec.message = line;
+
+        // Timestamps have a one second resolution
+        std::string date = field(line, "date", json);
+        std::string time = field(line, "time", json);
+        std::tm tm = {};
+        double at = last;
+        if (!time.empty()
+            && std::sscanf(time.c_str(), "%d:%d:%d", &tm.tm_hour, &tm.tm_min,
+                           &tm.tm_sec)
+                   == 3)
+        {
+            at = tm.tm_hour * 3600.0 + tm.tm_min * 60.0 + tm.tm_sec;
+            if (!date.empty()
+                && std::sscanf(date.c_str(), "%d-%d-%d", &tm.tm_year,
+                               &tm.tm_mon, &tm.tm_mday)
+                       == 3)
+            {
+                tm.tm_year -= 1900;
+                tm.tm_mon -= 1;
+                tm.tm_isdst = -1;
+                at = static_cast<double>(std::mktime(&tm));
+            }
+            else if (at + day + 43200 < last)
+                day += 86400; // midnight without a date
+            at += day;
+        }
+        if (first < 0)
+            first = at;
+        last = at;
+        rec.at = at - first;
+
+        std::string tid = field(line, "tid", json);
+        by_tid[tid].push_back(rec);
+    }
+
+    // Spread the records of the same second evenly across it
+    for (auto &[tid, records] : by_tid)
+    {
+        std::size_t i = 0;
+        while (i < records.size())
+        {
+            std::size_t j = i;
+            while (j < records.size() && records[j].at == records[i].at)
+                ++j;
+            for (std::size_t k = i; k < j; ++k)
+                records[k].at += static_cast<double>(k - i)
+                                 / static_cast<double>(j - i);
+            i = j;
+        }
+    }
+    return by_tid;
+}
+
+struct producer_result
+{
+    std::vector<double> samples;
+    std::size_t emitted = 0;    // messages above the level threshold
+};
+
+// Sleeping has a coarse granularity, spin for the last stretch
+static void sleep_until(std::uint64_t deadline_ns)
+{
+    for (auto now = now_ns(); now < deadline_ns; now = now_ns())
+    {
+        if (deadline_ns - now > 200000)
+            std::this_thread::sleep_for(
+                std::chrono::nanoseconds(deadline_ns - now - 100000));
+        else
+            std::this_thread::yield();
+    }
+}
+
+static producer_result generate(const workload &w, std::size_t index,
+                                std::uint64_t begin)
+{
+    std::mt19937_64 rng(w.seed + index);
+    std::vector<double> weights;
+    for (auto &[lvl, weight] : w.levels)
+        weights.push_back(weight);
+    std::discrete_distribution<std::size_t> pick_level(weights.begin(),
+                                                       weights.end());
+    std::uniform_int_distribution<std::size_t> uniform(w.size_min,
+                                                       w.size_max);
+    std::exponential_distribution<double> exponential(1.0 / w.size_mean);
+    std::string payload(w.size_max, 'x');
+    auto threshold = oak::get_level();
+
+    producer_result r;
+    auto end = begin + static_cast<std::uint64_t>(w.duration * 1e9);
+    double interval = w.rate > 0 ? 1e9 / w.rate : 0;
+    for (std::uint64_t seq = 0;; ++seq)
+    {
+        // bursts of `burst` messages keep the average rate
+        auto slot = static_cast<double>(seq / w.burst * w.burst);
+        auto scheduled = begin + static_cast<std::uint64_t>(slot * interval);
+        if (scheduled >= end || now_ns() >= end)
+            break;
+        sleep_until(scheduled);
+
+        std::size_t size = w.size_max;
+        if (w.sizes == size_distribution::uniform)
+            size = uniform(rng);
+        else if (w.sizes == size_distribution::exponential)
+            size = std::clamp(static_cast<std::size_t>(exponential(rng)),
+                              w.size_min, w.size_max);
+        auto lvl = w.levels[pick_level(rng)].first;
+        std::string_view message(payload.data(), size);
+
+        auto start = now_ns();
+        oak::log(lvl, "loadgen thread={} seq={} {}", index, seq, message);
+        r.samples.push_back(static_cast<double>(now_ns() - start));
+        if (lvl >= threshold)
+            r.emitted++;
+    }
+    return r;
+}
+
+static producer_result replay(const std::vector<replay_record> &records,
+                              double speed, std::uint64_t begin)
+{
+    auto threshold = oak::get_level();
+    producer_result r;
+    for (auto &rec : records)
+    {
+        sleep_until(begin + static_cast<std::uint64_t>(rec.at / speed * 1e9));
+        auto start = now_ns();
+        oak::log(rec.lvl, "{}", rec.message);
+        r.samples.push_back(static_cast<double>(now_ns() - start));
+        if (rec.lvl >= threshold)
+            r.emitted++;
+    }
+    return r;
+}
+
+static std::size_t count_lines(const std::string &path)
+{
+    std::ifstream in(path);
+    std::size_t lines = 0;
+    std::string line;
+    while (std::getline(in, line))
+        ++lines;
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr,
+                     "usage: %s <workload.oak>\n"
+                     "       %s --replay <log file> [speed] [workload.oak]\n",
+                     argv[0], argv[0]);
+        return 1;
+    }
+
+    bool replay_mode = std::string(argv[1]) == "--replay";
+    std::string workload_path = replay_mode ? "" : argv[1];
+    double speed = 1;
+    if (replay_mode)
+    {
+        if (argc < 3)
+        {
+            std::fprintf(stderr, "missing log file to replay\n");
+            return 1;
+        }
+        if (argc > 3)
+            speed = std::max(std::atof(argv[3]), 1e-3);
+        if (argc > 4)
+            workload_path = argv[4];
+    }
+
+    workload w;
+    if (!workload_path.empty())
+    {
+        auto parsed = parse_workload(workload_path);
+        if (!parsed.has_value())
+        {
+            std::fprintf(stderr, "%s\n", parsed.error().c_str());
+            return 1;
+        }
+        w = parsed.value();
+    }
+
+    std::map<std::string, std::vector<replay_record>> records;
+    if (replay_mode)
+    {
+        auto parsed = parse_log(argv[2]);
+        if (!parsed.has_value())
+        {
+            std::fprintf(stderr, "%s\n", parsed.error().c_str());
+            return 1;
+        }
+        records = std::move(parsed.value());
+    }
+
+    if (!w.settings.empty())
+    {
+        auto r = oak::settings_file(w.settings);
+        if (!r.has_value())
+        {
+            std::fprintf(stderr, "%s\n", r.error().c_str());
+            return 1;
+        }
+    }
+    else
+    {
+        oak::set_level(oak::level::debug);
+        oak::set_flags(oak::flags::level, oak::flags::time);
+    }
+    if (!w.file.empty())
+    {
+        std::filesystem::remove(w.file);
+        auto r = oak::set_file(w.file);
+        if (!r.has_value())
+        {
+            std::fprintf(stderr, "%s\n", r.error().c_str());
+            return 1;
+        }
+    }
+
+    int report_fd = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!w.to_stdout && devnull >= 0)
+    {
+        std::fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+    }
+    std::FILE *report = fdopen(report_fd, "w");
+    if (report == nullptr)
+        return 1;
+
+    // Sample the queue depth while producing
+    std::atomic<bool> producing = true;
+    std::size_t max_depth = 0;
+    std::thread monitor(
+        [&producing, &max_depth]
+        {
+            while (producing.load())
+            {
+                max_depth = std::max(max_depth, oak::queue_size());
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+
+    oak::init_writer();
+    std::size_t producers = replay_mode ? records.size() : w.threads;
+    std::vector<producer_result> results(producers);
+    std::vector<std::thread> threads;
+    auto begin = now_ns() + 1000000;
+    if (replay_mode)
+    {
+        std::size_t i = 0;
+        for (auto &[tid, recs] : records)
+        {
+            threads.emplace_back([&results, &recs, i, speed, begin]
+                                 { results[i] = replay(recs, speed, begin); });
+            ++i;
+        }
+    }
+    else
+    {
+        for (std::size_t i = 0; i < producers; ++i)
+            threads.emplace_back([&results, &w, i, begin]
+                                 { results[i] = generate(w, i, begin); });
+    }
+    for (auto &t : threads)
+        t.join();
+    auto produced_at = now_ns();
+    producing = false;
+    monitor.join();
+
+    // The writer lag is the time needed to drain the backlog
+    std::size_t backlog = oak::queue_size();
+    oak::stop_writer();
+    oak::flush();
+    auto drained_at = now_ns();
+
+    result r;
+    r.name = replay_mode ? "replay" : "loadgen";
+    std::size_t emitted = 0;
+    for (auto &p : results)
+    {
+        r.samples.insert(r.samples.end(), p.samples.begin(), p.samples.end());
+        emitted += p.emitted;
+    }
+    r.ops = r.samples.size();
+    r.wall_ns = static_cast<double>(drained_at - (begin - 1000000));
+
+    std::fprintf(report, "producers: %zu\n", producers);
+    print_header(report);
+    print_result(report, r);
+    std::fprintf(report, "producer latency histogram:\n");
+    print_histogram(report, r.samples);
+    std::fprintf(report, "max queue depth: %zu\n", max_depth);
+    std::fprintf(report, "backlog: %zu queued at the end, drained in %.3f ms\n",
+                 backlog,
+                 static_cast<double>(drained_at - produced_at) / 1e6);
+
+    auto snap = oak::stats();
+    std::fprintf(report,
+                 "enqueue wait: mean %.0f ns, p50 < %llu ns, p99 < %llu ns, "
+                 "max %llu ns\n",
+                 snap.enqueue_wait.mean(),
+                 static_cast<unsigned long long>(snap.enqueue_wait.percentile(50)),
+                 static_cast<unsigned long long>(snap.enqueue_wait.percentile(99)),
+                 static_cast<unsigned long long>(snap.enqueue_wait.max));
+    std::fprintf(report,
+                 "writer lag: mean %.0f ns, p50 < %llu ns, p99 < %llu ns, "
+                 "max %llu ns\n",
+                 snap.writer_lag.mean(),
+                 static_cast<unsigned long long>(snap.writer_lag.percentile(50)),
+                 static_cast<unsigned long long>(snap.writer_lag.percentile(99)),
+                 static_cast<unsigned long long>(snap.writer_lag.max));
+    std::fprintf(report, "queue high water: %zu, drops: %llu\n",
+                 snap.queue_high_water,
+                 static_cast<unsigned long long>(snap.drops));
+
+    if (!w.file.empty())
+    {
+        oak::close_file();
+        std::size_t written = count_lines(w.file);
+        std::fprintf(report, "written: %zu, dropped: %zu\n", written,
+                     emitted > written ? emitted - written : 0);
+    }
+    else
+        std::fprintf(report, "dropped: unknown, set `file` to count\n");
+
+    std::fclose(report);
+    if (devnull >= 0)
+        close(devnull);
+    return 0;
+}